@@ -0,0 +1,50 @@
+#include "bench.h"
+
+#define OBJECTS 4000000
+#define MAX_BATCH 128
+
+/**
+* Allocate and free n buffers of 256 bytes at a time, either with n single
+* calls or with one batch call each way.
+*/
+static double cycle_ns(size_t n, bool batch)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << 26);
+    void *ptrs[MAX_BATCH];
+    size_t rounds = OBJECTS / n;
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        if (batch)
+        {
+            buddy_malloc_batch(&pool, 256, n, ptrs);
+            buddy_free_batch(&pool, ptrs, n);
+            continue;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            ptrs[i] = buddy_malloc(&pool, 256);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            buddy_free(&pool, ptrs[i]);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    buddy_destroy(&pool);
+    return (double)elapsed / (double)(rounds * n);
+}
+
+void bench_batch(void)
+{
+    static const size_t sizes[] = {8, 32, 128};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "n=%zu single", sizes[i]);
+        bench_report("batch", name, cycle_ns(sizes[i], false), "ns/object");
+        snprintf(name, sizeof(name), "n=%zu batch", sizes[i]);
+        bench_report("batch", name, cycle_ns(sizes[i], true), "ns/object");
+    }
+}
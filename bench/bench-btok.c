@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include "bench.h"
+
+#define NSIZES 4096
+#define ROUNDS 20000
+
+/**
+* The loop based btok that lab.c used before it moved into lab.h. Kept here
+* only as the baseline for the comparison.
+*/
+static size_t btok_loop(size_t bytes)
+{
+    size_t kval = 0;
+    while ((UINT64_C(1) << kval) < bytes)
+    {
+        kval++;
+    }
+    return kval;
+}
+
+/**
+* Sizes skewed the way allocation traces usually are: mostly small nodes,
+* some page sized buffers and a few large ones.
+*/
+static void fill_sizes(size_t *sizes, size_t n)
+{
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t r = bench_rand(&seed);
+        unsigned bucket = (unsigned)(r % 100);
+        if (bucket < 70)
+        {
+            sizes[i] = 16 + (r >> 8) % 240;
+        }
+        else if (bucket < 95)
+        {
+            sizes[i] = 256 + (r >> 8) % 3840;
+        }
+        else
+        {
+            sizes[i] = 4096 + (r >> 8) % (UINT64_C(1) << 20);
+        }
+        sizes[i] += sizeof(struct buddy_header);
+    }
+}
+
+static double time_ns(size_t (*fn)(size_t), const size_t *sizes, size_t *sink)
+{
+    size_t acc = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < ROUNDS; r++)
+    {
+        for (size_t i = 0; i < NSIZES; i++)
+        {
+            acc += fn(sizes[i]);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    *sink += acc;
+    return (double)elapsed / ((double)ROUNDS * NSIZES);
+}
+
+static size_t btok_inline(size_t bytes)
+{
+    return btok(bytes);
+}
+
+void bench_btok(void)
+{
+    static size_t sizes[NSIZES];
+    fill_sizes(sizes, NSIZES);
+    //Keep the results alive so the compiler can not drop either loop
+    volatile size_t sink = 0;
+    size_t acc = 0;
+    bench_report("btok", "loop", time_ns(btok_loop, sizes, &acc), "ns/call");
+    bench_report("btok", "clz", time_ns(btok_inline, sizes, &acc), "ns/call");
+    sink = acc;
+    (void)sink;
+}
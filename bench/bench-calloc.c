@@ -0,0 +1,55 @@
+#include <string.h>
+#include "bench.h"
+
+#define ROUNDS 200
+
+/**
+* Zeroed buffers of size bytes from buddy_calloc against buddy_malloc plus
+* memset. The buffer is written every stride bytes before it is freed, so
+* every buffer after the first is dirty and the time includes faulting back
+* in the pages calloc dropped.
+*/
+static void run(size_t size, size_t stride)
+{
+    double ns[2];
+    for (int calloc_it = 0; calloc_it < 2; calloc_it++)
+    {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << 30);
+        uint64_t start = bench_now_ns();
+        for (size_t r = 0; r < ROUNDS; r++)
+        {
+            unsigned char *mem;
+            if (calloc_it)
+            {
+                mem = buddy_calloc(&pool, 1, size);
+            }
+            else
+            {
+                mem = buddy_malloc(&pool, size);
+                memset(mem, 0, size);
+            }
+            for (size_t i = 0; i < size; i += stride)
+            {
+                mem[i] = 1;
+            }
+            buddy_free(&pool, mem);
+        }
+        ns[calloc_it] = (double)(bench_now_ns() - start) / ROUNDS / 1000.0;
+        buddy_destroy(&pool);
+    }
+    char name[64];
+    const char *use = stride < size ? "every page" : "first byte";
+    snprintf(name, sizeof(name), "%zu KiB %s malloc+memset", size / 1024, use);
+    bench_report("calloc", name, ns[0], "us/buffer");
+    snprintf(name, sizeof(name), "%zu KiB %s calloc", size / 1024, use);
+    bench_report("calloc", name, ns[1], "us/buffer");
+}
+
+void bench_calloc(void)
+{
+    run(UINT64_C(1) << 12, 64);
+    run(UINT64_C(1) << 18, 4096);
+    run(UINT64_C(1) << 23, 4096);
+    run(UINT64_C(1) << 23, UINT64_C(1) << 23);
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BLOCKS 256
+#define BLOCK_SIZE (UINT64_C(1) << 20)
+#define CYCLES 2000
+
+/**
+* Resident set size of the process in KiB, read from /proc/self/statm.
+*/
+static double rss_kib(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+    {
+        return 0.0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(f);
+    return (double)resident * (double)sysconf(_SC_PAGESIZE) / 1024.0;
+}
+
+/**
+* Fill the pool with 256 MiB of touched 1 MiB blocks, free them and report
+* how much stays resident. Then time a malloc/touch/free cycle of one block,
+* which pays for faulting the pages back in when they were decommitted.
+*/
+static void run(const char *metric, size_t threshold, int advice)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << 30);
+    buddy_set_decommit(&pool, threshold, advice);
+    static void *ptrs[BLOCKS];
+    double before = rss_kib();
+    for (size_t i = 0; i < BLOCKS; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, BLOCK_SIZE - sizeof(struct buddy_header));
+        memset(ptrs[i], 1, BLOCK_SIZE - sizeof(struct buddy_header));
+    }
+    double peak = rss_kib();
+    for (size_t i = 0; i < BLOCKS; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    double after = rss_kib();
+
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < CYCLES; i++)
+    {
+        unsigned char *p = buddy_malloc(&pool, BLOCK_SIZE / 2);
+        memset(p, 1, BLOCK_SIZE / 2);
+        buddy_free(&pool, p);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    buddy_destroy(&pool);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s peak rss", metric);
+    bench_report("decommit", name, (peak - before) / 1024.0, "MiB");
+    snprintf(name, sizeof(name), "%s rss after free", metric);
+    bench_report("decommit", name, (after - before) / 1024.0, "MiB");
+    snprintf(name, sizeof(name), "%s reuse 512K", metric);
+    bench_report("decommit", name, (double)elapsed / CYCLES / 1000.0, "us/cycle");
+}
+
+void bench_decommit(void)
+{
+    run("off", 0, MADV_DONTNEED);
+    run("dontneed 64K", UINT64_C(1) << 16, MADV_DONTNEED);
+    run("free 64K", UINT64_C(1) << 16, MADV_FREE);
+}
@@ -0,0 +1,84 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bench.h"
+
+#define REGION (UINT64_C(1) << 29)
+#define ACCESSES 20000000
+
+/**
+* Open a counter for data TLB read misses of this thread, or -1 when perf
+* events are not available.
+*/
+static int dtlb_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+* Random 8 byte updates over a 512 MiB block, so nearly every access lands
+* on a different page.
+*/
+static void run(const char *metric, unsigned int flags)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 30, flags);
+    uint64_t *mem = buddy_malloc(&pool, REGION - sizeof(struct buddy_header));
+    size_t words = (REGION - sizeof(struct buddy_header)) / sizeof(uint64_t);
+    memset(mem, 0, words * sizeof(uint64_t));
+
+    int fd = dtlb_counter();
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t seed = 0x94d049bb133111eb;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < ACCESSES; i++)
+    {
+        mem[bench_rand(&seed) % words]++;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    uint64_t misses = 0;
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+        {
+            misses = 0;
+        }
+        close(fd);
+    }
+    unsigned int got = pool.flags;
+    buddy_free(&pool, mem);
+    buddy_destroy(&pool);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", metric,
+        (got & BUDDY_HUGETLB) ? " (hugetlb)" : (got & BUDDY_THP) ? " (thp)" : " (4K)");
+    bench_report("hugepages", name, (double)elapsed / ACCESSES, "ns/access");
+    if (fd >= 0)
+    {
+        bench_report("hugepages", name, (double)misses / ACCESSES, "dTLB misses/access");
+    }
+}
+
+void bench_hugepages(void)
+{
+    run("normal", 0);
+    run("thp", BUDDY_THP);
+    run("hugetlb 2M", BUDDY_HUGETLB);
+}
@@ -0,0 +1,38 @@
+#include <stdlib.h>
+#include "bench.h"
+
+#define LIVE (UINT64_C(1) << 20)
+#define OPS 4000000
+
+/**
+* Random churn over a large set of live objects, so the buddies coalescing
+* looks at are usually cold. Compares inline headers with side bitmaps.
+*/
+static double churn_ns(unsigned int flags)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 30, flags);
+    void **live = calloc(LIVE, sizeof(void *));
+    uint64_t seed = 0xbf58476d1ce4e5b9;
+    for (size_t i = 0; i < LIVE; i++)
+    {
+        live[i] = buddy_malloc(&pool, 32 + bench_rand(&seed) % 480);
+    }
+    uint64_t start = bench_now_ns();
+    for (size_t op = 0; op < OPS; op++)
+    {
+        size_t i = bench_rand(&seed) % LIVE;
+        buddy_free(&pool, live[i]);
+        live[i] = buddy_malloc(&pool, 32 + bench_rand(&seed) % 480);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    free(live);
+    buddy_destroy(&pool);
+    return (double)elapsed / OPS;
+}
+
+void bench_layout(void)
+{
+    bench_report("layout", "churn header", churn_ns(0), "ns/free+malloc");
+    bench_report("layout", "churn noheader", churn_ns(BUDDY_NOHEADER), "ns/free+malloc");
+}
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include "bench.h"
+
+#define MAX_LIVE 256
+#define OPS 1000000
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+* Total splits and merges the pool has done in every class.
+*/
+static void pool_counts(const struct buddy_pool *pool, uint64_t *splits, uint64_t *merges)
+{
+    *splits = 0;
+    *merges = 0;
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        *splits += pool->nsplit[k];
+        *merges += pool->nmerge[k];
+    }
+}
+
+/**
+* Steady state churn: keep nlive small buffers alive and replace a random one
+* on every step. Reports the average and tail latency of a free plus malloc
+* pair and how many splits and merges each step cost.
+*/
+static void churn(const char *mode, unsigned int flags, size_t nlive)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 26, flags);
+    uint64_t *lat = malloc(OPS * sizeof(uint64_t));
+    void *live[MAX_LIVE];
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = 0; i < nlive; i++)
+    {
+        live[i] = buddy_malloc(&pool, 16 + bench_rand(&seed) % 496);
+    }
+    uint64_t splits0;
+    uint64_t merges0;
+    pool_counts(&pool, &splits0, &merges0);
+    uint64_t total = 0;
+    for (size_t n = 0; n < OPS; n++)
+    {
+        size_t i = bench_rand(&seed) % nlive;
+        size_t size = 16 + bench_rand(&seed) % 496;
+        uint64_t start = bench_now_ns();
+        buddy_free(&pool, live[i]);
+        live[i] = buddy_malloc(&pool, size);
+        lat[n] = bench_now_ns() - start;
+        total += lat[n];
+    }
+    uint64_t splits;
+    uint64_t merges;
+    pool_counts(&pool, &splits, &merges);
+    splits -= splits0;
+    merges -= merges0;
+    qsort(lat, OPS, sizeof(uint64_t), u64_cmp);
+    char metric[64];
+    snprintf(metric, sizeof(metric), "live=%zu %s avg", nlive, mode);
+    bench_report("lazy", metric, (double)total / OPS, "ns/op");
+    snprintf(metric, sizeof(metric), "live=%zu %s p50", nlive, mode);
+    bench_report("lazy", metric, (double)lat[OPS / 2], "ns/op");
+    snprintf(metric, sizeof(metric), "live=%zu %s p99", nlive, mode);
+    bench_report("lazy", metric, (double)lat[OPS - OPS / 100], "ns/op");
+    snprintf(metric, sizeof(metric), "live=%zu %s splits", nlive, mode);
+    bench_report("lazy", metric, (double)splits / OPS, "per op");
+    snprintf(metric, sizeof(metric), "live=%zu %s merges", nlive, mode);
+    bench_report("lazy", metric, (double)merges / OPS, "per op");
+    for (size_t i = 0; i < nlive; i++)
+    {
+        buddy_free(&pool, live[i]);
+    }
+    free(lat);
+    buddy_destroy(&pool);
+}
+
+void bench_lazy(void)
+{
+    static const size_t lives[] = {4, MAX_LIVE};
+    for (size_t i = 0; i < sizeof(lives) / sizeof(lives[0]); i++)
+    {
+        churn("eager", 0, lives[i]);
+        churn("lazy", BUDDY_LAZY, lives[i]);
+    }
+}
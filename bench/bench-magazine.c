@@ -0,0 +1,139 @@
+#include <pthread.h>
+#include <sched.h>
+#include "bench.h"
+
+#define ITEMS 2000000
+#define RING 1024
+
+/**
+* Single producer single consumer ring used to hand blocks between threads.
+*/
+struct ring
+{
+    void *slots[RING];
+    size_t head; /*Next slot the producer writes*/
+    size_t tail; /*Next slot the consumer reads*/
+};
+
+struct pc_arg
+{
+    struct buddy_pool *pool;
+    struct ring *ring;
+    size_t depth; /*Magazine depth, 0 to use the pool directly*/
+};
+
+static void *producer(void *argp)
+{
+    struct pc_arg *arg = argp;
+    struct buddy_cache cache;
+    buddy_cache_init(&cache, arg->pool, arg->depth);
+    uint64_t seed = 0x853c49e6748fea9b;
+    for (size_t i = 0; i < ITEMS; i++)
+    {
+        size_t size = 16 + bench_rand(&seed) % 240;
+        void *p = arg->depth ? buddy_cache_malloc(&cache, size) : buddy_malloc(arg->pool, size);
+        while (__atomic_load_n(&arg->ring->head, __ATOMIC_RELAXED) -
+            __atomic_load_n(&arg->ring->tail, __ATOMIC_ACQUIRE) == RING)
+        {
+            sched_yield();
+        }
+        arg->ring->slots[arg->ring->head % RING] = p;
+        __atomic_store_n(&arg->ring->head, arg->ring->head + 1, __ATOMIC_RELEASE);
+    }
+    buddy_cache_flush(&cache);
+    return NULL;
+}
+
+static void *consumer(void *argp)
+{
+    struct pc_arg *arg = argp;
+    struct buddy_cache cache;
+    buddy_cache_init(&cache, arg->pool, arg->depth);
+    for (size_t i = 0; i < ITEMS; i++)
+    {
+        while (__atomic_load_n(&arg->ring->head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&arg->ring->tail, __ATOMIC_RELAXED))
+        {
+            sched_yield();
+        }
+        void *p = arg->ring->slots[arg->ring->tail % RING];
+        __atomic_store_n(&arg->ring->tail, arg->ring->tail + 1, __ATOMIC_RELEASE);
+        if (arg->depth)
+        {
+            buddy_cache_free(&cache, p);
+        }
+        else
+        {
+            buddy_free(arg->pool, p);
+        }
+    }
+    buddy_cache_flush(&cache);
+    return NULL;
+}
+
+static double run(size_t depth)
+{
+    struct buddy_pool pool;
+    buddy_init_concurrent(&pool, UINT64_C(1) << 26);
+    static struct ring ring;
+    ring.head = ring.tail = 0;
+    struct pc_arg arg = {&pool, &ring, depth};
+    pthread_t prod, cons;
+    uint64_t start = bench_now_ns();
+    pthread_create(&prod, NULL, producer, &arg);
+    pthread_create(&cons, NULL, consumer, &arg);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    uint64_t elapsed = bench_now_ns() - start;
+    buddy_destroy(&pool);
+    return (double)elapsed / ITEMS;
+}
+
+/**
+* The same thread allocating and freeing, the case magazines are built for.
+*/
+static double local_pairs(size_t depth)
+{
+    struct buddy_pool pool;
+    buddy_init_concurrent(&pool, UINT64_C(1) << 26);
+    struct buddy_cache cache;
+    buddy_cache_init(&cache, &pool, depth);
+    uint64_t seed = 0x853c49e6748fea9b;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < ITEMS; i++)
+    {
+        size_t size = 16 + bench_rand(&seed) % 240;
+        if (depth)
+        {
+            buddy_cache_free(&cache, buddy_cache_malloc(&cache, size));
+        }
+        else
+        {
+            buddy_free(&pool, buddy_malloc(&pool, size));
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    buddy_cache_flush(&cache);
+    buddy_destroy(&pool);
+    return (double)elapsed / ITEMS;
+}
+
+void bench_magazine(void)
+{
+    bench_report("magazine", "local pair pool", local_pairs(0), "ns/pair");
+    bench_report("magazine", "local pair depth=32", local_pairs(32), "ns/pair");
+    static const size_t depths[] = {0, 8, 32, 128};
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+    {
+        char metric[64];
+        if (depths[i] == 0)
+        {
+            snprintf(metric, sizeof(metric), "producer/consumer pool");
+        }
+        else
+        {
+            snprintf(metric, sizeof(metric), "producer/consumer depth=%zu", depths[i]);
+        }
+        bench_report("magazine", metric, run(depths[i]), "ns/item");
+    }
+}
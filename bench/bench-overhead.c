@@ -0,0 +1,48 @@
+#include "bench.h"
+
+#define OBJECTS 100000
+#define OLD_HEADER 24 /*sizeof(struct avail), the header every block used to carry*/
+
+/**
+* Allocate a mix of 64 B - 4 KiB objects and compare the bytes the pool hands
+* out against what was asked for. The same mix is also rounded up with the
+* old 24 byte header so both layouts can be compared side by side.
+*/
+void bench_overhead(void)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << 30);
+    uint64_t seed = 0xda942042e4dd58b5;
+    size_t requested = 0;
+    size_t granted = 0;
+    size_t granted_old = 0;
+    size_t objects = 0;
+    for (size_t i = 0; i < OBJECTS; i++)
+    {
+        //Uniform over the log of the size so every class gets traffic
+        size_t k = 6 + bench_rand(&seed) % 6;
+        size_t size = (UINT64_C(1) << k) + bench_rand(&seed) % (UINT64_C(1) << k);
+        void *p = buddy_malloc(&pool, size);
+        if (p == NULL)
+        {
+            break;
+        }
+        objects++;
+        requested += size;
+        granted += UINT64_C(1) << ((struct buddy_header *)p - 1)->kval;
+        size_t old_k = btok(size + OLD_HEADER);
+        granted_old += UINT64_C(1) << (old_k < SMALLEST_K ? SMALLEST_K : old_k);
+    }
+    buddy_destroy(&pool);
+    bench_report("overhead", "requested", (double)requested / 1024.0, "KiB");
+    bench_report("overhead", "granted 24B header", (double)granted_old / 1024.0, "KiB");
+    bench_report("overhead", "granted 8B header", (double)granted / 1024.0, "KiB");
+    bench_report("overhead", "header bytes 24B header",
+        100.0 * (double)(objects * OLD_HEADER) / (double)requested, "%");
+    bench_report("overhead", "header bytes 8B header",
+        100.0 * (double)(objects * sizeof(struct buddy_header)) / (double)requested, "%");
+    bench_report("overhead", "overhead 24B header",
+        100.0 * (double)(granted_old - requested) / (double)requested, "%");
+    bench_report("overhead", "overhead 8B header",
+        100.0 * (double)(granted - requested) / (double)requested, "%");
+}
@@ -0,0 +1,71 @@
+#include <string.h>
+#include "bench.h"
+
+#define ROUNDS 2000
+#define MAX_BYTES (UINT64_C(1) << 20)
+
+/**
+* Grow a buffer by doubling from 64 bytes to MAX_BYTES, either with
+* buddy_realloc or with the malloc+memcpy+free callers had to write before.
+*/
+static double grow_ns(bool use_realloc, bool pinned, size_t *moves)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << 24);
+    //A small neighbour at the base turns every buffer into an upper buddy so
+    //nothing can grow in place
+    void *pin = pinned ? buddy_malloc(&pool, 1) : NULL;
+    uint64_t start = bench_now_ns();
+    for (size_t r = 0; r < ROUNDS; r++)
+    {
+        size_t cap = 64;
+        unsigned char *buf = buddy_malloc(&pool, cap);
+        while (cap < MAX_BYTES)
+        {
+            size_t next = cap * 2;
+            unsigned char *grown;
+            if (use_realloc)
+            {
+                grown = buddy_realloc(&pool, buf, next);
+            }
+            else
+            {
+                grown = buddy_malloc(&pool, next);
+                memcpy(grown, buf, cap);
+                buddy_free(&pool, buf);
+            }
+            *moves += grown != buf;
+            buf = grown;
+            cap = next;
+        }
+        buddy_free(&pool, buf);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    if (pin != NULL)
+    {
+        buddy_free(&pool, pin);
+    }
+    buddy_destroy(&pool);
+    return (double)elapsed / ROUNDS;
+}
+
+void bench_realloc(void)
+{
+    static const char *names[2][2] = {
+        {"copy", "buddy_realloc"},
+        {"copy pinned", "buddy_realloc pinned"},
+    };
+    for (int pinned = 0; pinned < 2; pinned++)
+    {
+        for (int use_realloc = 0; use_realloc < 2; use_realloc++)
+        {
+            size_t moves = 0;
+            char metric[64];
+            double ns = grow_ns(use_realloc, pinned, &moves);
+            snprintf(metric, sizeof(metric), "%s", names[pinned][use_realloc]);
+            bench_report("realloc", metric, ns / 1000.0, "us/buffer");
+            snprintf(metric, sizeof(metric), "%s moves", names[pinned][use_realloc]);
+            bench_report("realloc", metric, (double)moves / ROUNDS, "moves/buffer");
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "bench.h"
+
+#define ITEMS 200000
+
+struct handoff
+{
+    struct buddy_pool *pool;
+    void *slots[ITEMS];
+    size_t published; /*Buffers the producer has handed out so far*/
+    size_t taken; /*Next buffer a consumer takes*/
+};
+
+static void *consumer_run(void *argp)
+{
+    struct handoff *handoff = argp;
+    while (true)
+    {
+        size_t i = __atomic_fetch_add(&handoff->taken, 1, __ATOMIC_RELAXED);
+        if (i >= ITEMS)
+        {
+            return NULL;
+        }
+        while (__atomic_load_n(&handoff->published, __ATOMIC_ACQUIRE) <= i)
+        {
+            sched_yield();
+        }
+        buddy_free(handoff->pool, handoff->slots[i]);
+    }
+}
+
+/**
+* One producer allocates buffers that nconsumers threads free, the pattern
+* of an I/O thread feeding workers. Returns million buffers per second.
+*/
+static double pipeline(size_t nconsumers, unsigned int flags)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 28, flags);
+    struct handoff *handoff = calloc(1, sizeof(struct handoff));
+    handoff->pool = &pool;
+    pthread_t *threads = calloc(nconsumers, sizeof(pthread_t));
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    uint64_t start = bench_now_ns();
+    for (size_t t = 0; t < nconsumers; t++)
+    {
+        pthread_create(&threads[t], NULL, consumer_run, handoff);
+    }
+    for (size_t i = 0; i < ITEMS; i++)
+    {
+        handoff->slots[i] = buddy_malloc(&pool, 64 + bench_rand(&seed) % 2048);
+        __atomic_store_n(&handoff->published, i + 1, __ATOMIC_RELEASE);
+    }
+    for (size_t t = 0; t < nconsumers; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    free(threads);
+    free(handoff);
+    buddy_destroy(&pool);
+    return (double)ITEMS * 1000.0 / (double)elapsed;
+}
+
+void bench_remote(void)
+{
+    size_t max = bench_max_threads();
+    for (size_t n = 1; n <= max; n = (n * 2 > max && n < max) ? max : n * 2)
+    {
+        char metric[64];
+        snprintf(metric, sizeof(metric), "per-class locks consumers=%zu", n);
+        bench_report("remote", metric, pipeline(n, BUDDY_CONCURRENT), "Mbuf/s");
+        snprintf(metric, sizeof(metric), "remote free consumers=%zu", n);
+        bench_report("remote", metric, pipeline(n, BUDDY_REMOTE_FREE), "Mbuf/s");
+    }
+}
@@ -0,0 +1,53 @@
+#include <errno.h>
+#include "bench.h"
+
+#define POOL_K DEFAULT_K
+#define PAIR_ITERS 1000000
+
+/**
+* Fill a pool with objects of the given size until it reports ENOMEM and
+* return how many live objects it held.
+*/
+static size_t fill_count(size_t size)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << POOL_K);
+    size_t count = 0;
+    while (buddy_malloc(&pool, size) != NULL)
+    {
+        count++;
+    }
+    buddy_destroy(&pool);
+    return count;
+}
+
+/**
+* Time a tight malloc/free pair loop for the given size.
+*/
+static double pair_ns(size_t size)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << POOL_K);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < PAIR_ITERS; i++)
+    {
+        void *p = buddy_malloc(&pool, size);
+        buddy_free(&pool, p);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    buddy_destroy(&pool);
+    return (double)elapsed / PAIR_ITERS;
+}
+
+void bench_size_classes(void)
+{
+    static const size_t sizes[] = {32, 256, 4096};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        char metric[64];
+        snprintf(metric, sizeof(metric), "objects/pool size=%zu", sizes[i]);
+        bench_report("size-classes", metric, (double)fill_count(sizes[i]), "objs");
+        snprintf(metric, sizeof(metric), "malloc+free size=%zu", sizes[i]);
+        bench_report("size-classes", metric, pair_ns(sizes[i]), "ns/pair");
+    }
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include "bench.h"
+
+#define LIVE 500000
+#define OPS 4000000
+
+/**
+* Bytes of the pool in use, found by walking the free lists.
+*/
+static size_t pool_used(struct buddy_pool *pool)
+{
+    size_t free_bytes = 0;
+    for (size_t k = 0; k <= pool->kval_m; k++)
+    {
+        for (struct avail *b = pool->avail[k].next; b != &pool->avail[k]; b = b->next)
+        {
+            free_bytes += UINT64_C(1) << k;
+        }
+    }
+    return pool->numbytes - free_bytes;
+}
+
+/**
+* Fill a pool with 16 - 256 byte nodes through the slab layer or straight from
+* the pool, then churn random frees and mallocs over the live set.
+*/
+static void run(const char *metric, bool slab)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << 30);
+    struct buddy_slab_cache cache;
+    buddy_slab_init(&cache, &pool);
+    void **live = calloc(LIVE, sizeof(void *));
+    uint64_t seed = 0x2545f4914f6cdd1d;
+    size_t requested = 0;
+    for (size_t i = 0; i < LIVE; i++)
+    {
+        size_t size = 16 + bench_rand(&seed) % 241;
+        live[i] = slab ? buddy_slab_malloc(&cache, size) : buddy_malloc(&pool, size);
+        requested += size;
+    }
+    size_t used = pool_used(&pool);
+
+    uint64_t start = bench_now_ns();
+    for (size_t op = 0; op < OPS; op++)
+    {
+        size_t i = bench_rand(&seed) % LIVE;
+        size_t size = 16 + bench_rand(&seed) % 241;
+        if (slab)
+        {
+            buddy_slab_free(&cache, live[i]);
+            live[i] = buddy_slab_malloc(&cache, size);
+        }
+        else
+        {
+            buddy_free(&pool, live[i]);
+            live[i] = buddy_malloc(&pool, size);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    size_t churned = pool_used(&pool);
+    free(live);
+    buddy_slab_destroy(&cache);
+    buddy_destroy(&pool);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s overhead filled", metric);
+    bench_report("slab", name, 100.0 * (double)(used - requested) / (double)requested, "%");
+    snprintf(name, sizeof(name), "%s overhead churned", metric);
+    bench_report("slab", name, 100.0 * (double)(churned - requested) / (double)requested, "%");
+    snprintf(name, sizeof(name), "%s churn", metric);
+    bench_report("slab", name, (double)elapsed / OPS, "ns/free+malloc");
+}
+
+void bench_slab(void)
+{
+    run("buddy", false);
+    run("slab", true);
+}
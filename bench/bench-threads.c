@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define OPS_PER_THREAD 200000
+#define LIVE 128
+
+struct worker
+{
+    struct buddy_pool *pool;
+    pthread_mutex_t *global; /*Non NULL to serialize every call on one mutex*/
+    uint64_t seed;
+};
+
+static void *worker_run(void *argp)
+{
+    struct worker *w = argp;
+    void *live[LIVE] = {0};
+    for (size_t op = 0; op < OPS_PER_THREAD; op++)
+    {
+        uint64_t r = bench_rand(&w->seed);
+        size_t i = r % LIVE;
+        if (w->global)
+        {
+            pthread_mutex_lock(w->global);
+        }
+        if (live[i] != NULL)
+        {
+            buddy_free(w->pool, live[i]);
+            live[i] = NULL;
+        }
+        else
+        {
+            live[i] = buddy_malloc(w->pool, 16 + (r >> 16) % 1024);
+        }
+        if (w->global)
+        {
+            pthread_mutex_unlock(w->global);
+        }
+    }
+    for (size_t i = 0; i < LIVE; i++)
+    {
+        if (live[i] != NULL)
+        {
+            buddy_free(w->pool, live[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+* Run nthreads workers against one pool created with flags and return million
+* ops per second. A pool without BUDDY_CONCURRENT is serialized on one mutex.
+*/
+static double run(size_t nthreads, unsigned int flags)
+{
+    struct buddy_pool pool;
+    pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+    buddy_init_flags(&pool, UINT64_C(1) << 28, flags);
+    bool global_lock = !(pool.flags & BUDDY_CONCURRENT);
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    uint64_t start = bench_now_ns();
+    for (size_t t = 0; t < nthreads; t++)
+    {
+        workers[t].pool = &pool;
+        workers[t].global = global_lock ? &global : NULL;
+        workers[t].seed = 0x2545f4914f6cdd1d + t;
+        pthread_create(&threads[t], NULL, worker_run, &workers[t]);
+    }
+    for (size_t t = 0; t < nthreads; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    free(threads);
+    free(workers);
+    buddy_destroy(&pool);
+    return (double)(nthreads * OPS_PER_THREAD) * 1000.0 / (double)elapsed;
+}
+
+/**
+* Scale from 1 to N threads where N is the number of online cores, or the
+* value of BENCH_THREADS when it is set.
+*/
+size_t bench_max_threads(void)
+{
+    const char *env = getenv("BENCH_THREADS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+void bench_threads(void)
+{
+    size_t max = bench_max_threads();
+    for (size_t n = 1; n <= max; n = (n * 2 > max && n < max) ? max : n * 2)
+    {
+        char metric[64];
+        snprintf(metric, sizeof(metric), "global mutex threads=%zu", n);
+        bench_report("threads", metric, run(n, 0), "Mops/s");
+        snprintf(metric, sizeof(metric), "per-class locks threads=%zu", n);
+        bench_report("threads", metric, run(n, BUDDY_CONCURRENT), "Mops/s");
+        snprintf(metric, sizeof(metric), "lock-free threads=%zu", n);
+        bench_report("threads", metric, run(n, BUDDY_LOCKFREE), "Mops/s");
+    }
+}
@@ -0,0 +1,51 @@
+#include <string.h>
+#include "bench.h"
+
+struct bench
+{
+    const char *name; /*Name used to select the benchmark on the command line*/
+    void (*run)(void); /*Entry point*/
+};
+
+static const struct bench benches[] = {
+    {"size-classes", bench_size_classes},
+    {"btok", bench_btok},
+    {"realloc", bench_realloc},
+    {"threads", bench_threads},
+    {"magazine", bench_magazine},
+    {"overhead", bench_overhead},
+    {"layout", bench_layout},
+    {"decommit", bench_decommit},
+    {"hugepages", bench_hugepages},
+    {"slab", bench_slab},
+    {"batch", bench_batch},
+    {"calloc", bench_calloc},
+    {"lazy", bench_lazy},
+    {"remote", bench_remote},
+};
+
+int main(int argc, char **argv)
+{
+    size_t n = sizeof(benches) / sizeof(benches[0]);
+    int ran = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (argc > 1 && strcmp(argv[1], benches[i].name) != 0)
+        {
+            continue;
+        }
+        benches[i].run();
+        ran++;
+    }
+    if (ran == 0)
+    {
+        fprintf(stderr, "Unknown benchmark: %s\nAvailable:", argv[1]);
+        for (size_t i = 0; i < n; i++)
+        {
+            fprintf(stderr, " %s", benches[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    return 0;
+}
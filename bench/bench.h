@@ -0,0 +1,59 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "../src/lab.h"
+
+/**
+* Monotonic clock in nanoseconds used to time all benchmarks.
+*/
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+* Small xorshift generator so runs are reproducible and do not depend on
+* the quality (or locking) of rand().
+*/
+static inline uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+* Print one result line in a fixed format so runs can be diffed.
+*/
+static inline void bench_report(const char *name, const char *metric, double value, const char *unit)
+{
+    printf("%-28s %-32s %14.2f %s\n", name, metric, value, unit);
+}
+
+void bench_size_classes(void);
+void bench_btok(void);
+void bench_realloc(void);
+void bench_threads(void);
+void bench_magazine(void);
+void bench_overhead(void);
+void bench_layout(void);
+void bench_decommit(void);
+void bench_hugepages(void);
+void bench_slab(void);
+void bench_batch(void);
+void bench_calloc(void);
+void bench_lazy(void);
+void bench_remote(void);
+
+/**
+* Number of threads the scaling benchmarks go up to.
+*/
+size_t bench_max_threads(void);
+#endif
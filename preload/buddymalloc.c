@@ -0,0 +1,328 @@
+/**
+* Replaces the malloc family of the C library (malloc, free, calloc, realloc,
+* reallocarray, posix_memalign, aligned_alloc, memalign, valloc, pvalloc and
+* malloc_usable_size) with a buddy pool so existing binaries can run on it
+* unchanged:
+*
+*     LD_PRELOAD=./libbuddymalloc.so ./some-program
+*
+* The pool is created on the first call. It is a BUDDY_CONCURRENT pool so
+* any thread may allocate, and BUDDY_NOHEADER so every block is aligned to
+* its size, which gives malloc the alignment of max_align_t and
+* posix_memalign, aligned_alloc, memalign, valloc and pvalloc their
+* alignment for free. As in glibc, memalign rounds an alignment that is not a
+* power of two up to the next one. It reserves BUDDY_MALLOC_MAX bytes of
+* address space (1 GiB committed at first) and grows into it as needed.
+*
+* Requests the pool can not serve go to the C library's own allocator, and a
+* pointer that is not in the pool is handed back to it, so memory from any
+* source can be passed to any of these functions.
+*
+* Environment:
+*     BUDDY_MALLOC_MAX    Bytes of address space the pool may grow to
+*     BUDDY_MALLOC_STATS  Print the pool's counters to stderr at exit when set
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <errno.h>
+#include "../src/lab.h"
+
+/**
+* Size the pool starts at and the default size it may grow to.
+*/
+#define PRELOAD_SIZE (UINT64_C(1) << 30)
+#define PRELOAD_MAX (UINT64_C(1) << 38)
+/**
+* States of the pool.
+*/
+#define PRELOAD_NONE 0
+#define PRELOAD_INIT 1
+#define PRELOAD_READY 2
+
+//The C library's allocator, exported by glibc under these names
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static struct buddy_pool pool;
+static int state = PRELOAD_NONE;
+static bool print_stats;
+
+static void fork_prepare(void)
+{
+    buddy_pool_lock(&pool);
+}
+
+static void fork_done(void)
+{
+    buddy_pool_unlock(&pool);
+}
+
+static void report(void)
+{
+    struct buddy_stats stats;
+    buddy_stats(&pool, &stats);
+    fprintf(stderr, "buddymalloc[%d]: %llu allocs %llu frees %llu failed, "
+        "%zu bytes in use, peak %zu, %llu requested %llu granted\n",
+        (int)getpid(), (unsigned long long)stats.allocs, (unsigned long long)stats.frees,
+        (unsigned long long)stats.failed, stats.bytes_in_use, stats.peak_bytes_in_use,
+        (unsigned long long)stats.bytes_requested, (unsigned long long)stats.bytes_granted);
+}
+
+/**
+* @brief Create the pool on first use. Threads that get here while another
+* is creating it wait, and a call made by the creating thread itself (should
+* anything below allocate) is told the pool is not ready so it falls back to
+* the C library.
+*
+* @return true when the pool can be used
+*/
+static bool ready(void)
+{
+    int s = __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+    if (s == PRELOAD_READY)
+    {
+        return true;
+    }
+    static __thread bool initializing;
+    if (initializing)
+    {
+        return false;
+    }
+    if (s == PRELOAD_NONE && __atomic_compare_exchange_n(&state, &s, PRELOAD_INIT, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        initializing = true;
+        size_t max = PRELOAD_MAX;
+        const char *env = getenv("BUDDY_MALLOC_MAX");
+        if (env != NULL && strtoull(env, NULL, 0) != 0)
+        {
+            max = (size_t)strtoull(env, NULL, 0);
+        }
+        buddy_init_reserve(&pool, max < PRELOAD_SIZE ? max : PRELOAD_SIZE, max,
+            BUDDY_CONCURRENT | BUDDY_NOHEADER);
+        pthread_atfork(fork_prepare, fork_done, fork_done);
+        if (getenv("BUDDY_MALLOC_STATS") != NULL)
+        {
+            print_stats = true;
+        }
+        initializing = false;
+        __atomic_store_n(&state, PRELOAD_READY, __ATOMIC_RELEASE);
+        return true;
+    }
+    while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != PRELOAD_READY)
+    {
+        sched_yield();
+    }
+    return true;
+}
+
+/**
+* @brief True when ptr was handed out by the pool
+*/
+static inline bool owned(void *ptr)
+{
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != PRELOAD_READY)
+    {
+        return false;
+    }
+    unsigned char *base = pool.base;
+    return (unsigned char *)ptr >= base &&
+        (unsigned char *)ptr < base + __atomic_load_n(&pool.numbytes, __ATOMIC_RELAXED);
+}
+
+__attribute__((destructor))
+static void preload_exit(void)
+{
+    if (print_stats)
+    {
+        report();
+    }
+}
+
+
+void *malloc(size_t size)
+{
+    if (ready())
+    {
+        //malloc(0) still has to return a pointer that can be freed
+        void *mem = buddy_malloc(&pool, size == 0 ? 1 : size);
+        if (mem != NULL)
+        {
+            return mem;
+        }
+    }
+    return __libc_malloc(size);
+}
+
+
+void free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if (owned(ptr))
+    {
+        buddy_free(&pool, ptr);
+        return;
+    }
+    __libc_free(ptr);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (ready())
+    {
+        size_t total = nmemb * size;
+        void *mem = buddy_calloc(&pool, total == 0 ? 1 : nmemb, total == 0 ? 1 : size);
+        if (mem != NULL)
+        {
+            return mem;
+        }
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+    if (!owned(ptr))
+    {
+        return __libc_realloc(ptr, size);
+    }
+    if (size == 0)
+    {
+        buddy_free(&pool, ptr);
+        return NULL;
+    }
+    void *mem = buddy_realloc(&pool, ptr, size);
+    if (mem != NULL)
+    {
+        return mem;
+    }
+
+    //The pool is out of room, move the data to the C library
+    mem = __libc_malloc(size);
+    if (mem != NULL)
+    {
+        size_t old = buddy_usable_size(&pool, ptr);
+        memcpy(mem, ptr, old < size ? old : size);
+        buddy_free(&pool, ptr);
+    }
+    return mem;
+}
+
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    void *mem = ready() ? buddy_aligned_alloc(&pool, align, size == 0 ? 1 : size) : NULL;
+    if (mem == NULL)
+    {
+        mem = __libc_memalign(align, size);
+        if (mem == NULL)
+        {
+            return ENOMEM;
+        }
+    }
+    *memptr = mem;
+    return 0;
+}
+
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *mem = ready() ? buddy_aligned_alloc(&pool, align, size == 0 ? 1 : size) : NULL;
+    return mem != NULL ? mem : __libc_memalign(align, size);
+}
+
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+
+void *memalign(size_t align, size_t size)
+{
+    //Like the C library, take an alignment that is not a power of two as the
+    //next power of two up
+    if (align > SIZE_MAX / 2 + 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    align = (size_t)1 << btok(align);
+    void *mem = ready() ? buddy_aligned_alloc(&pool, align, size == 0 ? 1 : size) : NULL;
+    return mem != NULL ? mem : __libc_memalign(align, size);
+}
+
+
+void *valloc(size_t size)
+{
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+
+void *pvalloc(size_t size)
+{
+    //Round up to whole pages
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - (page - 1))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+    if (owned(ptr))
+    {
+        return buddy_usable_size(&pool, ptr);
+    }
+    static size_t (*next)(void *);
+    size_t (*fn)(void *) = __atomic_load_n(&next, __ATOMIC_RELAXED);
+    if (fn == NULL)
+    {
+        fn = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+        __atomic_store_n(&next, fn, __ATOMIC_RELAXED);
+    }
+    return fn != NULL ? fn(ptr) : 0;
+}
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "lab.h"
+
+/**
+* @brief Take the arena lock for reading (allocating and freeing inside the
+* existing regions) or writing (adding and removing regions). Arenas that
+* were not created with BUDDY_CONCURRENT are not locked at all.
+*/
+static inline void arena_lock(struct buddy_arena *arena, bool write)
+{
+    if (!(arena->flags & BUDDY_CONCURRENT))
+    {
+        return;
+    }
+    if (write)
+    {
+        pthread_rwlock_wrlock(&arena->lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&arena->lock);
+    }
+}
+
+static inline void arena_unlock(struct buddy_arena *arena)
+{
+    if (arena->flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_unlock(&arena->lock);
+    }
+}
+
+/**
+* @brief kval of the block buddy_malloc picks for size bytes in region
+*/
+static inline size_t region_kval(struct buddy_pool *region, size_t size)
+{
+    size_t kval = btok(size + buddy_hdr_size(region));
+    return kval < SMALLEST_K ? SMALLEST_K : kval;
+}
+
+/**
+* @brief Map the descriptor of a new region and initialize it as a pool of kval
+*/
+static struct buddy_pool *region_new(struct buddy_arena *arena, size_t kval)
+{
+    struct buddy_pool *region = mmap(NULL, sizeof(struct buddy_pool), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == region)
+    {
+        return NULL;
+    }
+    buddy_init_flags(region, UINT64_C(1) << kval, arena->flags);
+    return region;
+}
+
+static void region_delete(struct buddy_pool *region)
+{
+    buddy_destroy(region);
+    munmap(region, sizeof(struct buddy_pool));
+}
+
+/**
+* @brief True when the whole region is a single free block. A BUDDY_LAZY or
+* BUDDY_LOCKFREE region can hold all of its memory in blocks that were never
+* merged, so once the free blocks add up to the whole region they are
+* compacted before looking again.
+*/
+static bool region_empty(struct buddy_pool *region)
+{
+    size_t whole = (UINT64_C(1) << region->kval_m) - buddy_hdr_size(region);
+    if (buddy_largest_free(region) == whole)
+    {
+        return true;
+    }
+    if (!(region->flags & (BUDDY_LAZY | BUDDY_LOCKFREE)))
+    {
+        return false;
+    }
+    size_t bytes = 0;
+    for (size_t k = SMALLEST_K; k <= region->kval_m; k++)
+    {
+        bytes += __atomic_load_n(&region->nfree[k], __ATOMIC_RELAXED) << k;
+    }
+    return bytes == (UINT64_C(1) << region->kval_m) && buddy_compact(region) != 0 &&
+        buddy_largest_free(region) == whole;
+}
+
+/**
+* @brief Find the region that holds ptr, or NULL. Caller holds the arena lock.
+*/
+static struct buddy_pool *region_of(struct buddy_arena *arena, void *ptr)
+{
+    for (size_t i = 0; i < arena->nregions; i++)
+    {
+        unsigned char *base = arena->regions[i]->base;
+        if ((unsigned char *)ptr >= base && (unsigned char *)ptr < base + arena->regions[i]->numbytes)
+        {
+            return arena->regions[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+* @brief Allocate from the existing regions, newest first. buddy_largest_free
+* reads the occupancy mask of each region, so full regions are skipped
+* without taking any of their locks. Caller holds the arena lock.
+*/
+static void *arena_try(struct buddy_arena *arena, size_t size)
+{
+    for (size_t i = arena->nregions; i-- > 0;)
+    {
+        struct buddy_pool *region = arena->regions[i];
+        if (buddy_largest_free(region) < size)
+        {
+            continue;
+        }
+        void *ptr = buddy_malloc(region, size);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+
+void buddy_arena_init(struct buddy_arena *arena, size_t region_size, unsigned int flags)
+{
+    size_t kval = region_size == 0 ? DEFAULT_K : btok(region_size);
+    if (kval < MIN_K)
+    kval = MIN_K;
+    if (kval >= MAX_K)
+    kval = MAX_K - 1;
+    memset(arena, 0, sizeof(struct buddy_arena));
+    arena->region_k = kval;
+    arena->flags = flags;
+    if (flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_init(&arena->lock, NULL);
+    }
+    arena->regions[0] = region_new(arena, kval);
+    if (arena->regions[0] == NULL)
+    {
+        perror("buddy_arena_init region mmap failed");
+        abort();
+    }
+    arena->nregions = 1;
+}
+
+
+void *buddy_arena_malloc(struct buddy_arena *arena, size_t size)
+{
+    if (arena == NULL || size == 0) {
+        fprintf(stderr, "Error: Invalid arguments passed to buddy_arena_malloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    arena_lock(arena, false);
+    void *ptr = arena_try(arena, size);
+    arena_unlock(arena);
+    if (ptr != NULL) {
+        return ptr;
+    }
+
+    // Another thread may have added a region while we waited for the lock
+    arena_lock(arena, true);
+    ptr = arena_try(arena, size);
+    if (ptr == NULL) {
+        size_t kval = region_kval(arena->regions[0], size);
+        if (kval < arena->region_k) {
+            kval = arena->region_k;
+        }
+        struct buddy_pool *region = NULL;
+        if (arena->nregions < BUDDY_ARENA_MAX_REGIONS && kval < MAX_K) {
+            region = region_new(arena, kval);
+        }
+        if (region != NULL) {
+            arena->regions[arena->nregions++] = region;
+            ptr = buddy_malloc(region, size);
+        }
+    }
+    arena_unlock(arena);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+
+void buddy_arena_free(struct buddy_arena *arena, void *ptr)
+{
+    if (arena == NULL || ptr == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_arena_free.\n");
+        return;
+    }
+
+    arena_lock(arena, false);
+    struct buddy_pool *region = region_of(arena, ptr);
+    if (region == NULL) {
+        arena_unlock(arena);
+        fprintf(stderr, "Error: Pointer is out of bounds in buddy_arena_free.\n");
+        return;
+    }
+    buddy_free(region, ptr);
+    bool empty = region != arena->regions[0] && region_empty(region);
+    arena_unlock(arena);
+    if (!empty) {
+        return;
+    }
+
+    // Nobody else is inside a region while we hold the lock for writing, so
+    // the region is only released if it is still there and still empty
+    arena_lock(arena, true);
+    for (size_t i = 1; i < arena->nregions; i++) {
+        if (arena->regions[i] == region && region_empty(region)) {
+            memmove(&arena->regions[i], &arena->regions[i + 1],
+                (arena->nregions - i - 1) * sizeof(arena->regions[0]));
+            arena->nregions--;
+            region_delete(region);
+            break;
+        }
+    }
+    arena_unlock(arena);
+}
+
+
+void *buddy_arena_realloc(struct buddy_arena *arena, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return buddy_arena_malloc(arena, size);
+    }
+
+    if (arena == NULL) {
+        fprintf(stderr, "Error: Null pointer passed as arena to buddy_arena_realloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (size == 0) {
+        buddy_arena_free(arena, ptr);
+        return NULL;
+    }
+
+    arena_lock(arena, false);
+    struct buddy_pool *region = region_of(arena, ptr);
+    if (region == NULL) {
+        arena_unlock(arena);
+        fprintf(stderr, "Error: Pointer is out of bounds in buddy_arena_realloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+    void *mem = buddy_realloc(region, ptr, size);
+    size_t usable = 0;
+    if (mem == NULL && errno == ENOMEM) {
+        usable = buddy_usable_size(region, ptr);
+    }
+    arena_unlock(arena);
+    if (mem != NULL || usable == 0) {
+        return mem;
+    }
+
+    // The region is full, move the data to another one
+    mem = buddy_arena_malloc(arena, size);
+    if (mem == NULL) {
+        return NULL;
+    }
+    memcpy(mem, ptr, usable < size ? usable : size);
+    buddy_arena_free(arena, ptr);
+    return mem;
+}
+
+
+void buddy_arena_destroy(struct buddy_arena *arena)
+{
+    for (size_t i = 0; i < arena->nregions; i++)
+    {
+        region_delete(arena->regions[i]);
+    }
+    if (arena->flags & BUDDY_CONCURRENT)
+    {
+        pthread_rwlock_destroy(&arena->lock);
+    }
+    memset(arena, 0, sizeof(struct buddy_arena));
+}
@@ -14,6 +14,12 @@
 #include <errno.h>
 #endif
 #include "lab.h"
+//An allocated block is viewed through struct buddy_header and a free one
+//through struct avail, so their leading members have to line up
+_Static_assert(offsetof(struct buddy_header, tag) == offsetof(struct avail, tag), "tag offset");
+_Static_assert(offsetof(struct buddy_header, kval) == offsetof(struct avail, kval), "kval offset");
+_Static_assert(offsetof(struct buddy_header, unused) == offsetof(struct avail, clean), "clean offset");
+_Static_assert(sizeof(struct avail) <= (UINT64_C(1) << SMALLEST_K), "SMALLEST_K too small");
 #define handle_error_and_die(msg) \
 do \
 { \
@@ -21,317 +27,2296 @@ do \
     raise(SIGKILL); \
 } while (0)
 
-#define BLOCK_USED 1
 
+/**
+* @brief Index of the lowest set bit of a non-zero mask
+*/
+static inline size_t mask_ctz(uint64_t mask)
+{
+    assert(mask != 0);
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)__builtin_ctzll(mask);
+#else
+    size_t k = 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        k++;
+    }
+    return k;
+#endif
+}
 
 /**
-* @brief Convert bytes to the correct K value
-*
-* @param bytes the number of bytes
-* @return size_t the K value that will fit bytes
+* @brief Index of the highest set bit of a non-zero mask
+*/
+static inline size_t mask_top(uint64_t mask)
+{
+    assert(mask != 0);
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)(63 - __builtin_clzll(mask));
+#else
+    size_t k = 63;
+    while (!(mask & (UINT64_C(1) << k)))
+    {
+        k--;
+    }
+    return k;
+#endif
+}
+
+/**
+* @brief Take the lock protecting avail[kval]. Pools that were not created
+* with BUDDY_CONCURRENT are not locked at all.
 */
+static inline void class_lock(struct buddy_pool *pool, size_t kval)
+{
+    if (pool->flags & BUDDY_CONCURRENT)
+    {
+        pthread_mutex_lock(&pool->locks[kval]);
+    }
+}
+
 /**
- * @brief Convert bytes to the correct K value
- *
- * This function calculates the smallest power of 2 (K) that can accommodate
- * the given number of bytes. The K value is used in the buddy memory allocation
- * system to determine the size class of memory blocks.
- *
- * Instructions to implement:
- * 1. Validate the input parameter `bytes` to ensure it is greater than zero.
- * 2. Start with an initial K value of 0.
- * 3. Use a loop to repeatedly shift the value 1 (representing 2^K) to the left
- *    until it is greater than or equal to `bytes`.
- * 4. Increment the K value during each iteration of the loop.
- * 5. Return the calculated K value.
- *
- * Notes:
- * - Avoid using floating-point operations or math libraries like `math.pow`.
- * - Ensure the function handles edge cases, such as very small or very large
- *   values of `bytes`.
- */
-size_t btok(size_t bytes)
+* @brief Release the lock taken by class_lock
+*/
+static inline void class_unlock(struct buddy_pool *pool, size_t kval)
 {
-    // Ensure the input is greater than zero
-    assert(bytes > 0);
+    if (pool->flags & BUDDY_CONCURRENT)
+    {
+        pthread_mutex_unlock(&pool->locks[kval]);
+    }
+}
 
-    // Add the size of the header to the requested bytes
-    //bytes += sizeof(struct avail);
+/**
+* @brief Read the occupancy mask. In a concurrent pool every bit is owned by
+* the lock of its class, so the word itself is only ever updated atomically.
+* A BUDDY_LOCKFREE pool has no mask and builds one from the free counts.
+*/
+static inline uint64_t mask_load(struct buddy_pool *pool)
+{
+    if (pool->flags & BUDDY_LOCKFREE)
+    {
+        uint64_t mask = 0;
+        size_t top = __atomic_load_n(&pool->kval_m, __ATOMIC_RELAXED);
+        for (size_t k = SMALLEST_K; k <= top; k++)
+        {
+            if (__atomic_load_n(&pool->nfree[k], __ATOMIC_RELAXED) != 0)
+            {
+                mask |= UINT64_C(1) << k;
+            }
+        }
+        return mask;
+    }
+    if (pool->flags & BUDDY_CONCURRENT)
+    {
+        return __atomic_load_n(&pool->avail_mask, __ATOMIC_RELAXED);
+    }
+    return pool->avail_mask;
+}
 
-    // Initialize K value
-    size_t kval = 0;
+static inline void mask_set(struct buddy_pool *pool, size_t kval)
+{
+    if (pool->flags & BUDDY_CONCURRENT)
+    {
+        __atomic_fetch_or(&pool->avail_mask, UINT64_C(1) << kval, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        pool->avail_mask |= UINT64_C(1) << kval;
+    }
+}
 
-    // Calculate the smallest power of 2 (K) that can accommodate the bytes
-    while ((UINT64_C(1) << kval) < bytes)
+static inline void mask_clear(struct buddy_pool *pool, size_t kval)
+{
+    if (pool->flags & BUDDY_CONCURRENT)
     {
-        kval++;
+        __atomic_fetch_and(&pool->avail_mask, ~(UINT64_C(1) << kval), __ATOMIC_RELAXED);
+    }
+    else
+    {
+        pool->avail_mask &= ~(UINT64_C(1) << kval);
     }
+}
 
-    return kval;
+/**
+* @brief Current size of the pool. A pool created with buddy_init_reserve
+* grows while other threads use it, so these are read atomically.
+*/
+static inline size_t pool_kval_m(struct buddy_pool *pool)
+{
+    return __atomic_load_n(&pool->kval_m, __ATOMIC_RELAXED);
+}
+
+static inline size_t pool_numbytes(struct buddy_pool *pool)
+{
+    return __atomic_load_n(&pool->numbytes, __ATOMIC_RELAXED);
 }
 
+/**
+* @brief Set the tag and kval of a block header. In a concurrent pool a header
+* may be inspected by a thread holding a different class lock than the writer,
+* so header fields are accessed with relaxed atomics (plain moves on x86).
+*/
+static inline void hdr_store(struct avail *block, unsigned short tag, size_t kval)
+{
+    __atomic_store_n(&block->tag, tag, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->kval, (unsigned short)kval, __ATOMIC_RELAXED);
+}
 
+/**
+* @brief True when block is a free block of exactly kval. Only meaningful while
+* holding the lock of class kval.
+*/
+static inline bool hdr_is_avail(struct avail *block, size_t kval)
+{
+    return __atomic_load_n(&block->tag, __ATOMIC_RELAXED) == BLOCK_AVAIL &&
+        __atomic_load_n(&block->kval, __ATOMIC_RELAXED) == kval;
+}
 
 /**
- * Calculates the buddy block for a given block in a buddy memory pool.
- *
- * @param pool A pointer to the buddy memory pool structure. This structure
- *             contains information about the memory pool and its configuration.
- * @param buddy A pointer to the structure representing the block for which
- *              the buddy block needs to be calculated. This structure should
- *              contain details such as the block's address or index.
- * 
- * @return A pointer to the structure representing the calculated buddy block.
- *         This structure will contain the details of the buddy block, such as
- *         its address or index.
- *
- * Instructions to implement:
- * - Use the block's address or index to determine its buddy block.
- * - Ensure the calculation adheres to the buddy memory allocation algorithm.
- * - Validate the input parameters to ensure they are not NULL and are within
- *   the bounds of the memory pool.
- * - Return the calculated buddy block structure or handle errors appropriately
- *   if the calculation fails.
- */
-struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
+* @brief True when size user bytes and the header fit in the largest block
+* the pool can grow to. Checked before the header is added, so a size close
+* to SIZE_MAX can not wrap around to a small block.
+*/
+static inline bool size_fits(struct buddy_pool *pool, size_t size)
 {
-    assert(pool != NULL);
-    assert(buddy != NULL);
+    return size <= (UINT64_C(1) << pool->kval_max) - buddy_hdr_size(pool);
+}
 
-    // Calculate the offset of the buddy block
-    size_t block_offset = (unsigned char *)buddy - (unsigned char *)pool->base;
+/**
+* @brief kval of the block that buddy_malloc hands out for size user bytes,
+* MAX_K when adding the header would wrap
+*/
+static inline size_t size_kval(struct buddy_pool *pool, size_t size)
+{
+    if (size > SIZE_MAX - buddy_hdr_size(pool))
+    {
+        return MAX_K;
+    }
+    size_t kval = btok(size + buddy_hdr_size(pool));
+    return kval < SMALLEST_K ? SMALLEST_K : kval;
+}
 
-    // Calculate the size of the block using its kval
-    size_t block_size = UINT64_C(1) << buddy->kval;
+/**
+* @brief Index of block in the side bitmaps of class kval
+*/
+static inline size_t map_index(struct buddy_pool *pool, const void *block, size_t kval)
+{
+    return (size_t)((const unsigned char *)block - (const unsigned char *)pool->base) >> kval;
+}
 
-    // XOR the block offset with the block size to find the buddy's offset
-    size_t buddy_offset = block_offset ^ block_size;
+static inline bool map_test(const uint64_t *map, size_t i)
+{
+    return (__atomic_load_n(&map[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
 
-    // Return the pointer to the buddy block
-    return (struct avail *)((unsigned char *)pool->base + buddy_offset);
+/**
+* @brief Set or clear bit i of map. Bits of neighbouring blocks share a word,
+* so concurrent pools update it atomically, as do pools whose bits other
+* threads read to check a remote free.
+*/
+static inline void map_update(struct buddy_pool *pool, uint64_t *map, size_t i, bool set)
+{
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    if (pool->flags & (BUDDY_CONCURRENT | BUDDY_REMOTE_FREE))
+    {
+        if (set)
+        {
+            __atomic_fetch_or(&map[i / 64], bit, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_fetch_and(&map[i / 64], ~bit, __ATOMIC_RELAXED);
+        }
+    }
+    else if (set)
+    {
+        map[i / 64] |= bit;
+    }
+    else
+    {
+        map[i / 64] &= ~bit;
+    }
+}
+
+/**
+* @brief Record that block is handed out as a block of kval. With headers the
+* state lives in the block itself, in a BUDDY_NOHEADER pool it is the block's
+* bit in the alloc bitmap of its class.
+*/
+static inline void blk_reserve(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (pool->flags & BUDDY_NOHEADER)
+    {
+        map_update(pool, pool->alloc_map[kval], map_index(pool, block, kval), true);
+    }
+    else
+    {
+        hdr_store(block, BLOCK_RESERVED, kval);
+    }
+}
+
+/**
+* @brief Mark a block that was just taken off a free list (or is in the middle
+* of being split or merged) as not free. A BUDDY_NOHEADER pool already cleared
+* its free bit, so the block itself is left alone.
+*/
+static inline void blk_hold(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (!(pool->flags & BUDDY_NOHEADER))
+    {
+        hdr_store(block, BLOCK_RESERVED, kval);
+    }
+}
+
+/**
+* @brief Forget that block was handed out as a block of kval
+*/
+static inline void blk_unreserve(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (pool->flags & BUDDY_NOHEADER)
+    {
+        map_update(pool, pool->alloc_map[kval], map_index(pool, block, kval), false);
+    }
+}
+
+/**
+* @brief True when block is a free block of exactly kval. A BUDDY_NOHEADER
+* pool answers from the free bitmap without touching the block. Only
+* meaningful while holding the lock of class kval.
+*/
+static inline bool blk_is_free(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (pool->flags & BUDDY_NOHEADER)
+    {
+        return map_test(pool->free_map[kval], map_index(pool, block, kval));
+    }
+    return hdr_is_avail(block, kval);
+}
+
+/**
+* @brief Push a free block onto the front of avail[kval] and mark the class
+* as non-empty in the occupancy mask. Caller holds the class lock.
+*
+* @param clean Offset from which the block is known to be zero, 0 if unknown
+*/
+static inline void avail_push(struct buddy_pool *pool, struct avail *block, size_t kval, size_t clean)
+{
+    struct avail *head = &pool->avail[kval];
+    hdr_store(block, BLOCK_AVAIL, kval);
+    block->clean = (unsigned int)clean;
+    block->next = head->next;
+    block->prev = head;
+    head->next->prev = block;
+    head->next = block;
+    __atomic_store_n(&pool->nfree[kval], pool->nfree[kval] + 1, __ATOMIC_RELAXED);
+    mask_set(pool, kval);
+    if (pool->flags & BUDDY_NOHEADER)
+    {
+        map_update(pool, pool->free_map[kval], map_index(pool, block, kval), true);
+    }
+}
+
+/**
+* @brief Unlink a free block from its avail list, clearing the class bit in the
+* occupancy mask when the list becomes empty. Caller holds the class lock.
+*/
+static inline void avail_remove(struct buddy_pool *pool, struct avail *block)
+{
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    __atomic_store_n(&pool->nfree[block->kval], pool->nfree[block->kval] - 1, __ATOMIC_RELAXED);
+    struct avail *head = &pool->avail[block->kval];
+    if (head->next == head)
+    {
+        mask_clear(pool, block->kval);
+    }
+    if (pool->flags & BUDDY_NOHEADER)
+    {
+        map_update(pool, pool->free_map[block->kval], map_index(pool, block, block->kval), false);
+    }
+}
+
+/**
+* @brief Publish a free block of kval in a BUDDY_LOCKFREE pool. Setting its
+* free bit is all it takes, the release order hands the clean offset over to
+* whichever thread claims the block next.
+*/
+static inline void lf_push(struct buddy_pool *pool, struct avail *block, size_t kval, size_t clean)
+{
+    size_t i = map_index(pool, block, kval);
+    block->clean = (unsigned int)clean;
+    __atomic_fetch_add(&pool->nfree[kval], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&pool->free_map[kval][i / 64], UINT64_C(1) << (i % 64), __ATOMIC_SEQ_CST);
+    uint64_t *sum = &pool->lf_summary[kval][i / 4096];
+    uint64_t sbit = UINT64_C(1) << (i / 64 % 64);
+    if (!(__atomic_load_n(sum, __ATOMIC_SEQ_CST) & sbit))
+    {
+        __atomic_fetch_or(sum, sbit, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&pool->lf_hint[kval], i / 64, __ATOMIC_RELAXED);
+}
+
+/**
+* @brief Try to take block of kval in a BUDDY_LOCKFREE pool by clearing its
+* free bit. Exactly one of any number of racing threads succeeds.
+*/
+static inline bool lf_claim(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    size_t i = map_index(pool, block, kval);
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    uint64_t *word = &pool->free_map[kval][i / 64];
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) ||
+        !(__atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST) & bit))
+    {
+        return false;
+    }
+    __atomic_fetch_sub(&pool->nfree[kval], 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+* @brief Claim any free block in word w of the free bitmap of kval
+*/
+static struct avail *lf_take_word(struct buddy_pool *pool, size_t kval, size_t w)
+{
+    uint64_t *word = &pool->free_map[kval][w];
+    uint64_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (bits != 0)
+    {
+        uint64_t bit = bits & (~bits + 1);
+        uint64_t old = __atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST);
+        if (old & bit)
+        {
+            __atomic_fetch_sub(&pool->nfree[kval], 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&pool->lf_hint[kval], w, __ATOMIC_RELAXED);
+            return (struct avail *)((unsigned char *)pool->base + ((w * 64 + mask_ctz(bit)) << kval));
+        }
+        bits = old & ~bit;
+    }
+    return NULL;
+}
+
+/**
+* @brief Claim any free block of kval in a BUDDY_LOCKFREE pool.
+*
+* A summary bitmap with one bit per word of the free bitmap narrows the
+* search to words that may have a free block, starting at the word a block
+* of the class was last published in or taken from. A bit found stale is
+* cleared and set again if the word gained a block meanwhile: lf_push sets
+* the word bit before it looks at the summary bit, so one of the two sees
+* the other.
+*/
+static struct avail *lf_take(struct buddy_pool *pool, size_t kval)
+{
+    uint64_t *sum = pool->lf_summary[kval];
+    size_t swords = ((pool_numbytes(pool) >> kval) + 4095) / 4096;
+    size_t s = __atomic_load_n(&pool->lf_hint[kval], __ATOMIC_RELAXED) / 64;
+    for (size_t n = 0; n < swords; n++, s++)
+    {
+        if (s >= swords)
+        {
+            s = 0;
+        }
+        uint64_t bits = __atomic_load_n(&sum[s], __ATOMIC_RELAXED);
+        while (bits != 0)
+        {
+            uint64_t sbit = bits & (~bits + 1);
+            bits &= bits - 1;
+            size_t w = s * 64 + mask_ctz(sbit);
+            struct avail *block = lf_take_word(pool, kval, w);
+            if (block != NULL)
+            {
+                return block;
+            }
+            __atomic_fetch_and(&sum[s], ~sbit, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&pool->free_map[kval][w], __ATOMIC_SEQ_CST) != 0)
+            {
+                __atomic_fetch_or(&sum[s], sbit, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+* @brief Put a free block of kval on its free list without looking at its
+* buddy, for blocks whose buddy is known to be in use.
+*/
+static void blk_publish(struct buddy_pool *pool, struct avail *block, size_t kval, size_t clean)
+{
+    if (pool->flags & BUDDY_LOCKFREE)
+    {
+        lf_push(pool, block, kval, clean);
+        return;
+    }
+    class_lock(pool, kval);
+    avail_push(pool, block, kval, clean);
+    class_unlock(pool, kval);
+}
+
+/**
+* @brief Take block off the free list of kval if it is a free block of that
+* class. Its clean offset is left in block->clean.
+*/
+static bool blk_claim(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (pool->flags & BUDDY_LOCKFREE)
+    {
+        return lf_claim(pool, block, kval);
+    }
+    class_lock(pool, kval);
+    bool free = blk_is_free(pool, block, kval);
+    if (free)
+    {
+        avail_remove(pool, block);
+        blk_hold(pool, block, kval);
+    }
+    class_unlock(pool, kval);
+    return free;
+}
+
+/**
+* @brief Hand len bytes at addr back to the OS. Failure only means the pages
+* stay resident, so it is ignored.
+*/
+static inline void mem_release(struct buddy_pool *pool, void *addr, size_t len)
+{
+    (void)madvise(addr, len, pool->decommit_advice);
+}
+
+/**
+* @brief Decommit a block that is about to become free. The first page keeps
+* the free list links so it stays resident. The caller must still own the
+* block, once it is on a free list another thread may already be using it.
+*
+* @return true when everything past the first page now reads as zero
+*/
+static inline bool blk_decommit(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (pool->decommit_k != 0 && kval >= pool->decommit_k)
+    {
+        mem_release(pool, (unsigned char *)block + pool->page_size,
+            (UINT64_C(1) << kval) - pool->page_size);
+        return pool->decommit_advice == MADV_DONTNEED;
+    }
+    return false;
+}
+
+/**
+* @brief Combine two clean offsets of the same block, 0 meaning unknown
+*/
+static inline size_t clean_min(size_t a, size_t b)
+{
+    if (a == 0 || b == 0)
+    {
+        return a | b;
+    }
+    return a < b ? a : b;
+}
+
+static bool pool_grow(struct buddy_pool *pool, size_t kval_m);
+static size_t compact(struct buddy_pool *pool);
+static size_t remote_drain(struct buddy_pool *pool);
+
+/**
+* @brief Claim a free block from the smallest class at or above kval that has
+* one and store that class in found.
+*
+* Only one class lock is held at a time: the block is claimed under the lock of
+* the class it came from and marked reserved before that lock is dropped, so
+* no other thread can mistake it for a free buddy while it is being split. A
+* BUDDY_LOCKFREE pool claims it by clearing its free bit instead.
+*/
+static struct avail *take_block(struct buddy_pool *pool, size_t kval, size_t *found)
+{
+    if (pool->flags & BUDDY_LOCKFREE)
+    {
+        size_t top = pool_kval_m(pool);
+        for (size_t i = kval; i <= top; i++)
+        {
+            struct avail *block = NULL;
+            if (__atomic_load_n(&pool->nfree[i], __ATOMIC_RELAXED) != 0)
+            {
+                block = lf_take(pool, i);
+            }
+            if (block != NULL)
+            {
+                *found = i;
+                return block;
+            }
+        }
+        return NULL;
+    }
+    uint64_t candidates = mask_load(pool) & ~((UINT64_C(1) << kval) - 1);
+    while (candidates != 0)
+    {
+        size_t i = mask_ctz(candidates);
+        class_lock(pool, i);
+        struct avail *head = &pool->avail[i];
+        if (head->next == head)
+        {
+            // Another thread emptied the class after we read the mask
+            class_unlock(pool, i);
+            candidates &= ~(UINT64_C(1) << i);
+            continue;
+        }
+        struct avail *block = head->next;
+        avail_remove(pool, block);
+        blk_hold(pool, block, i);
+        class_unlock(pool, i);
+        *found = i;
+        return block;
+    }
+    return NULL;
+}
+
+/**
+* @brief Split block, taken by take_block from class found, down to kval. Each
+* upper half is published under the lock of its own class.
+*
+* The split block's clean offset is passed on to the halves, and the one for
+* the returned block is left in its clean field (the unused member of
+* struct buddy_header) for buddy_calloc.
+*/
+static struct avail *split_block(struct buddy_pool *pool, struct avail *block, size_t found, size_t kval)
+{
+    size_t clean = block->clean;
+    while (found > kval)
+    {
+        found--;
+        size_t half = UINT64_C(1) << found;
+        struct avail *buddy = (struct avail *)((unsigned char *)block + half);
+        size_t buddy_clean = 0;
+        if (clean != 0)
+        {
+            buddy_clean = clean > half + sizeof(struct avail) ? clean - half : sizeof(struct avail);
+        }
+        blk_publish(pool, buddy, found, buddy_clean);
+        __atomic_fetch_add(&pool->nsplit[found], 1, __ATOMIC_RELAXED);
+    }
+    blk_reserve(pool, block, kval);
+    block->clean = (unsigned int)clean;
+    return block;
+}
+
+/**
+* @brief Take a free block of exactly kval out of the pool, splitting a larger
+* block if needed.
+*
+* @return The reserved block or NULL if no class at or above kval has a block
+* and the pool can not grow any further
+*/
+static struct avail *alloc_block(struct buddy_pool *pool, size_t kval)
+{
+    if ((pool->flags & BUDDY_REMOTE_FREE) && __atomic_load_n(&pool->remote, __ATOMIC_RELAXED) != NULL)
+    {
+        remote_drain(pool);
+    }
+    bool compacted = !(pool->flags & (BUDDY_LAZY | BUDDY_LOCKFREE));
+    size_t i = kval;
+    struct avail *block;
+    while ((block = take_block(pool, kval, &i)) == NULL)
+    {
+        // Deferred or missed merges may make a block big enough, failing
+        // that a pool with reserved address space doubles and tries again
+        if (!compacted)
+        {
+            compacted = true;
+            compact(pool);
+        }
+        else if (pool_grow(pool, pool_kval_m(pool)))
+        {
+            // The new upper half may not have merged either
+            compacted = !(pool->flags & (BUDDY_LAZY | BUDDY_LOCKFREE));
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+
+    return split_block(pool, block, i, kval);
+}
+
+/**
+* @brief Work out the clean offset of a block of kval just merged from two
+* buddies. Both halves were decommitted when they were freed apart from
+* their first pages, so only the stale links of the upper half remain and
+* are released here; a merge that just reached the threshold releases the
+* whole block.
+*
+* The merged block stays known zero from the lower half's clean offset only
+* if the upper half is zero all the way. That holds when its first page is
+* released with MADV_DONTNEED, or after clearing its few bytes of stale
+* links when the rest of it was clean.
+*/
+static size_t merge_clean(struct buddy_pool *pool, struct avail *block, struct avail *upper,
+    size_t kval, size_t lower_clean, size_t upper_clean)
+{
+    if (pool->decommit_k != 0 && kval > pool->decommit_k)
+    {
+        mem_release(pool, upper, pool->page_size);
+        return (upper_clean != 0 && pool->decommit_advice == MADV_DONTNEED) ? lower_clean : 0;
+    }
+    if (kval == pool->decommit_k && blk_decommit(pool, block, kval))
+    {
+        return clean_min(lower_clean, pool->page_size);
+    }
+    if (upper_clean != 0 && upper_clean <= sizeof(struct avail))
+    {
+        memset(upper, 0, upper_clean);
+        return lower_clean;
+    }
+    return 0;
+}
+
+/**
+* @brief free_block for a BUDDY_LOCKFREE pool, with the bitmaps as the only
+* state. The buddy is merged if it can be claimed straight away. Otherwise
+* the block is published and the buddy checked once more, because a thread
+* freeing the buddy at the same time may have looked before the block was
+* published; with sequentially consistent bit updates at least one of the two
+* sees both bits set. Racing threads both claim the lower half first so only
+* one of them goes on to merge.
+*/
+static void lf_free_block(struct buddy_pool *pool, struct avail *block, size_t kval, size_t clean)
+{
+    bool defer = (pool->flags & BUDDY_LAZY) != 0;
+    while (true)
+    {
+        size_t offset = (size_t)((unsigned char *)block - (unsigned char *)pool->base);
+        size_t buddy_offset = offset ^ (UINT64_C(1) << kval);
+        struct avail *buddy = (struct avail *)((unsigned char *)pool->base + buddy_offset);
+        struct avail *lower = buddy < block ? buddy : block;
+        struct avail *upper = buddy < block ? block : buddy;
+        bool merge = buddy_offset < pool_numbytes(pool) &&
+            !(defer && __atomic_load_n(&pool->nfree[kval], __ATOMIC_RELAXED) < pool->lazy_max[kval]);
+        if (merge && lf_claim(pool, buddy, kval))
+        {
+            block->clean = (unsigned int)clean;
+        }
+        else
+        {
+            lf_push(pool, block, kval, clean);
+            if (!merge || !map_test(pool->free_map[kval], map_index(pool, buddy, kval)) ||
+                !lf_claim(pool, lower, kval))
+            {
+                return;
+            }
+            if (!lf_claim(pool, upper, kval))
+            {
+                lf_push(pool, lower, kval, lower->clean);
+                return;
+            }
+        }
+        __atomic_fetch_add(&pool->nmerge[kval], 1, __ATOMIC_RELAXED);
+        defer = false;
+        block = lower;
+        kval++;
+        clean = merge_clean(pool, block, upper, kval, lower->clean, upper->clean);
+    }
+}
+
+/**
+* @brief Return a reserved block of kval to the pool, coalescing it with its
+* buddy for as long as the buddy is free.
+*
+* The buddy is only inspected while holding the lock of the current class. A
+* buddy that is free with a matching kval is on that class list, so claiming
+* it under the lock is safe. An absorbed lower buddy becomes the head of the
+* merged block and is marked reserved before the lock is released.
+*
+* In a BUDDY_LAZY pool the block is left in its own class without looking at
+* its buddy while that class is below its watermark.
+*
+* @param clean Offset from which block is known to be zero, 0 if unknown
+*/
+static void free_block(struct buddy_pool *pool, struct avail *block, size_t kval, size_t clean)
+{
+    blk_unreserve(pool, block, kval);
+    if (blk_decommit(pool, block, kval))
+    {
+        clean = clean_min(clean, pool->page_size);
+    }
+    if (pool->flags & BUDDY_LOCKFREE)
+    {
+        lf_free_block(pool, block, kval, clean);
+        return;
+    }
+    bool defer = (pool->flags & BUDDY_LAZY) != 0;
+    while (true)
+    {
+        // Calculate the buddy block
+        size_t offset = (size_t)((unsigned char *)block - (unsigned char *)pool->base);
+        size_t buddy_offset = offset ^ (UINT64_C(1) << kval);
+        struct avail *buddy = (struct avail *)((unsigned char *)pool->base + buddy_offset);
+        class_lock(pool, kval);
+        // The pool only grows while holding the lock of its top class
+        bool in_pool = buddy_offset < pool_numbytes(pool);
+        // Check if the buddy block is free and has the same kval
+        if (!in_pool || (defer && pool->nfree[kval] < pool->lazy_max[kval]) ||
+            !blk_is_free(pool, buddy, kval))
+        {
+            // Add the coalesced block back to the free list
+            avail_push(pool, block, kval, clean);
+            class_unlock(pool, kval);
+            return;
+        }
+
+        // Remove the buddy block from its free list
+        avail_remove(pool, buddy);
+        size_t buddy_clean = buddy->clean;
+        blk_hold(pool, buddy, kval);
+        __atomic_store_n(&pool->nmerge[kval], pool->nmerge[kval] + 1, __ATOMIC_RELAXED);
+        class_unlock(pool, kval);
+        defer = false;
+
+        // Determine the lower address between the block and its buddy
+        struct avail *upper = buddy < block ? block : buddy;
+        size_t upper_clean = buddy < block ? clean : buddy_clean;
+        size_t lower_clean = buddy < block ? buddy_clean : clean;
+        if (buddy < block)
+        {
+            block = buddy;
+        }
+
+        // Increase the kval of the coalesced block
+        kval++;
+        blk_hold(pool, block, kval);
+        clean = merge_clean(pool, block, upper, kval, lower_clean, upper_clean);
+    }
+}
+
+/**
+* @brief compact for a BUDDY_LOCKFREE pool. Free buddy pairs are found a
+* bitmap word at a time and claimed lower half first like lf_free_block does.
+*/
+static size_t lf_compact(struct buddy_pool *pool)
+{
+    size_t merges = 0;
+    size_t top = pool_kval_m(pool);
+    for (size_t k = SMALLEST_K; k < top; k++)
+    {
+        uint64_t *map = pool->free_map[k];
+        size_t words = ((pool_numbytes(pool) >> k) + 63) / 64;
+        for (size_t w = 0; w < words; w++)
+        {
+            uint64_t pairs = __atomic_load_n(&map[w], __ATOMIC_RELAXED);
+            pairs &= (pairs >> 1) & UINT64_C(0x5555555555555555);
+            while (pairs != 0)
+            {
+                size_t i = w * 64 + mask_ctz(pairs);
+                pairs &= pairs - 1;
+                struct avail *lower = (struct avail *)((unsigned char *)pool->base + (i << k));
+                struct avail *upper = (struct avail *)((unsigned char *)lower + (UINT64_C(1) << k));
+                if (!lf_claim(pool, lower, k))
+                {
+                    continue;
+                }
+                if (!lf_claim(pool, upper, k))
+                {
+                    lf_push(pool, lower, k, lower->clean);
+                    continue;
+                }
+                lf_push(pool, lower, k + 1, merge_clean(pool, lower, upper, k + 1, lower->clean, upper->clean));
+                __atomic_fetch_add(&pool->nmerge[k], 1, __ATOMIC_RELAXED);
+                merges++;
+            }
+        }
+    }
+    return merges;
+}
+
+/**
+* @brief Merge every pair of free buddies, smallest class first. Each class
+* is scanned holding its own lock and the lock of the class above, which
+* receives the merged blocks; locks are always taken in ascending order and
+* every other path holds one at a time.
+*/
+static size_t compact(struct buddy_pool *pool)
+{
+    if (pool->flags & BUDDY_LOCKFREE)
+    {
+        return lf_compact(pool);
+    }
+    size_t merges = 0;
+    size_t top = pool_kval_m(pool);
+    for (size_t k = SMALLEST_K; k < top; k++)
+    {
+        if (!(mask_load(pool) & (UINT64_C(1) << k)))
+        {
+            continue;
+        }
+        class_lock(pool, k);
+        class_lock(pool, k + 1);
+        struct avail *head = &pool->avail[k];
+        struct avail *block = head->next;
+        while (block != head)
+        {
+            struct avail *next = block->next;
+            size_t offset = (size_t)((unsigned char *)block - (unsigned char *)pool->base);
+            struct avail *buddy = (struct avail *)((unsigned char *)pool->base + (offset ^ (UINT64_C(1) << k)));
+            if (!blk_is_free(pool, buddy, k))
+            {
+                block = next;
+                continue;
+            }
+            if (next == buddy)
+            {
+                next = buddy->next;
+            }
+            avail_remove(pool, block);
+            avail_remove(pool, buddy);
+            struct avail *lower = buddy < block ? buddy : block;
+            struct avail *upper = buddy < block ? block : buddy;
+            size_t lower_clean = lower->clean;
+            size_t upper_clean = upper->clean;
+            blk_hold(pool, upper, k);
+            blk_hold(pool, lower, k + 1);
+            avail_push(pool, lower, k + 1, merge_clean(pool, lower, upper, k + 1, lower_clean, upper_clean));
+            __atomic_store_n(&pool->nmerge[k], pool->nmerge[k] + 1, __ATOMIC_RELAXED);
+            merges++;
+            block = next;
+        }
+        class_unlock(pool, k + 1);
+        class_unlock(pool, k);
+    }
+    return merges;
+}
+
+/**
+* Slots of concurrent pools this thread used last, indexed by stats_id. The
+* address of the cache doubles as the thread's token in slot owners.
+*/
+#define STATS_CACHE 4
+static __thread struct
+{
+    uint64_t id;
+    struct buddy_stats_slot *slot;
+} stats_cache[STATS_CACHE];
+static uint64_t stats_ids;
+
+/**
+* @brief Find or claim the stats slot of the calling thread in a concurrent
+* pool, NULL when every slot is taken by other threads.
+*/
+static struct buddy_stats_slot *stats_claim(struct buddy_pool *pool)
+{
+    uintptr_t token = (uintptr_t)stats_cache;
+    for (size_t i = 0; i < BUDDY_STATS_SLOTS; i++)
+    {
+        if (__atomic_load_n(&pool->stats[i].owner, __ATOMIC_RELAXED) == token)
+        {
+            return &pool->stats[i];
+        }
+    }
+    for (size_t i = 0; i < BUDDY_STATS_SLOTS; i++)
+    {
+        uintptr_t free_slot = 0;
+        if (__atomic_compare_exchange_n(&pool->stats[i].owner, &free_slot, token, false,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return &pool->stats[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+* @brief Counters the calling thread adds to
+*
+* @param shared Set when other threads write the same slot and additions
+* have to be atomic
+*/
+static inline struct buddy_stats_slot *stats_slot(struct buddy_pool *pool, bool *shared)
+{
+    *shared = false;
+    if (pool->stats == NULL)
+    {
+        return &pool->stats_shared;
+    }
+    size_t c = pool->stats_id % STATS_CACHE;
+    if (stats_cache[c].id != pool->stats_id)
+    {
+        stats_cache[c].id = pool->stats_id;
+        stats_cache[c].slot = stats_claim(pool);
+    }
+    if (stats_cache[c].slot == NULL)
+    {
+        *shared = true;
+        return &pool->stats_shared;
+    }
+    return stats_cache[c].slot;
+}
+
+/**
+* @brief Add v to a counter. Only the owning thread writes a slot of its
+* own, so that is a plain load and store; buddy_stats may read it meanwhile.
+*/
+static inline void stats_add(uint64_t *counter, uint64_t v, bool shared)
+{
+    if (shared)
+    {
+        __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+* @brief Bytes in use over all slots of a concurrent pool
+*/
+static uint64_t stats_in_use(struct buddy_pool *pool)
+{
+    uint64_t in_use = __atomic_load_n(&pool->stats_shared.granted, __ATOMIC_RELAXED) -
+        __atomic_load_n(&pool->stats_shared.freed, __ATOMIC_RELAXED);
+    for (size_t i = 0; pool->stats != NULL && i < BUDDY_STATS_SLOTS; i++)
+    {
+        in_use += __atomic_load_n(&pool->stats[i].granted, __ATOMIC_RELAXED) -
+            __atomic_load_n(&pool->stats[i].freed, __ATOMIC_RELAXED);
+    }
+    return in_use;
+}
+
+/**
+* @brief Raise the peak after slot handed out more memory. A pool used by
+* one thread compares its only slot every time. In a concurrent pool the
+* slots are added up when the slot's own usage passes its high mark, which
+* is then set a sixteenth above; usage through one slot goes negative when
+* it frees what others allocated, so the sums are signed.
+*/
+static inline void stats_peak(struct buddy_pool *pool, struct buddy_stats_slot *slot)
+{
+    int64_t mine = (int64_t)(__atomic_load_n(&slot->granted, __ATOMIC_RELAXED) -
+        __atomic_load_n(&slot->freed, __ATOMIC_RELAXED));
+    if (pool->stats == NULL)
+    {
+        if ((uint64_t)mine > pool->stats_peak)
+        {
+            pool->stats_peak = (uint64_t)mine;
+        }
+        return;
+    }
+    if (mine <= (int64_t)__atomic_load_n(&slot->high, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    __atomic_store_n(&slot->high, (uint64_t)(mine + mine / 16), __ATOMIC_RELAXED);
+    uint64_t total = stats_in_use(pool);
+    uint64_t peak = __atomic_load_n(&pool->stats_peak, __ATOMIC_RELAXED);
+    while ((int64_t)total > (int64_t)peak && !__atomic_compare_exchange_n(&pool->stats_peak,
+        &peak, total, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/**
+* @brief Count a successful allocation of requested bytes that got a block
+* of kval
+*/
+static inline void stats_alloc(struct buddy_pool *pool, size_t requested, size_t kval, size_t count)
+{
+    bool shared;
+    struct buddy_stats_slot *slot = stats_slot(pool, &shared);
+    stats_add(&slot->allocs, count, shared);
+    stats_add(&slot->requested, requested * count, shared);
+    stats_add(&slot->granted, (UINT64_C(1) << kval) * count, shared);
+    stats_peak(pool, slot);
+}
+
+/**
+* @brief Count an allocation that found no memory
+*/
+static inline void stats_fail(struct buddy_pool *pool)
+{
+    bool shared;
+    struct buddy_stats_slot *slot = stats_slot(pool, &shared);
+    stats_add(&slot->failed, 1, shared);
+}
+
+/**
+* @brief Count a freed block of kval
+*/
+static inline void stats_free(struct buddy_pool *pool, size_t kval)
+{
+    bool shared;
+    struct buddy_stats_slot *slot = stats_slot(pool, &shared);
+    stats_add(&slot->frees, 1, shared);
+    stats_add(&slot->freed, UINT64_C(1) << kval, shared);
+}
+
+/**
+* @brief Count an allocation resized in place from old_kval to kval, which
+* counts the requested bytes like a new allocation.
+*/
+static inline void stats_resize(struct buddy_pool *pool, size_t old_kval, size_t kval, size_t requested)
+{
+    bool shared;
+    struct buddy_stats_slot *slot = stats_slot(pool, &shared);
+    stats_add(&slot->requested, requested, shared);
+    stats_add(&slot->granted, UINT64_C(1) << kval, shared);
+    stats_add(&slot->freed, UINT64_C(1) << old_kval, shared);
+    stats_peak(pool, slot);
+}
+
+/**
+* @brief True when a free from the calling thread has to be queued for the
+* owner of the pool.
+*/
+static inline bool remote_free(struct buddy_pool *pool)
+{
+    return (pool->flags & BUDDY_REMOTE_FREE) && !pthread_equal(pool->owner, pthread_self());
+}
+
+/**
+* @brief Note the kval of a block about to be queued for the owner. A header
+* already holds it and may be read by the owner checking for a free buddy,
+* without one it goes into the first bytes of the block.
+*/
+static inline void remote_kval(struct buddy_pool *pool, struct avail *block, size_t kval)
+{
+    if (pool->flags & BUDDY_NOHEADER)
+    {
+        block->kval = (unsigned short)kval;
+    }
+}
+
+/**
+* @brief Push the chain of blocks from first to last, linked through next,
+* onto the remote free queue. The blocks are still reserved and belong to
+* the caller, so their links can be written before the release CAS makes
+* them visible to the owner.
+*/
+static void remote_push(struct buddy_pool *pool, struct avail *first, struct avail *last)
+{
+    struct avail *head = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+    do
+    {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->remote, &head, first, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+* @brief Take the whole remote free queue at once and free every block on
+* it. Only ever one thread empties the queue while any number push, so
+* there is no ABA problem.
+*/
+static size_t remote_drain(struct buddy_pool *pool)
+{
+    struct avail *block = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (block != NULL)
+    {
+        struct avail *next = block->next;
+        stats_free(pool, block->kval);
+        free_block(pool, block, block->kval, 0);
+        block = next;
+        n++;
+    }
+    return n;
+}
+
+/**
+* @brief Double a pool created with buddy_init_reserve by committing the next
+* 2^kval_m bytes of its reservation. The new upper half is freed like any
+* other block, so it merges with the old top block if that is free.
+*
+* Growth is serialised on the lock of the top class. free_block reads the
+* pool size under the lock of the class it merges in, and the only class
+* whose buddies move into the pool is the old top class.
+*
+* @param kval_m The size of the pool the caller found exhausted
+* @return true if the pool is now larger than kval_m
+*/
+static bool pool_grow(struct buddy_pool *pool, size_t kval_m)
+{
+    if (kval_m >= pool->kval_max)
+    {
+        return false;
+    }
+    class_lock(pool, kval_m);
+    if (pool_kval_m(pool) != kval_m)
+    {
+        // Another thread grew the pool first
+        class_unlock(pool, kval_m);
+        return true;
+    }
+    size_t bytes = UINT64_C(1) << kval_m;
+    struct avail *upper = (struct avail *)((unsigned char *)pool->base + bytes);
+    if (mprotect(upper, bytes, PROT_READ | PROT_WRITE) != 0)
+    {
+        class_unlock(pool, kval_m);
+        return false;
+    }
+#ifdef MADV_HUGEPAGE
+    if (pool->flags & BUDDY_THP)
+    {
+        (void)madvise(upper, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    __atomic_store_n(&pool->numbytes, 2 * bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->kval_m, kval_m + 1, __ATOMIC_RELAXED);
+    class_unlock(pool, kval_m);
+    free_block(pool, upper, kval_m, sizeof(struct avail));
+    return true;
+}
+
+/**
+ * Calculates the buddy block for a given block in a buddy memory pool.
+ *
+ * @param pool A pointer to the buddy memory pool structure. This structure
+ *             contains information about the memory pool and its configuration.
+ * @param buddy A pointer to the structure representing the block for which
+ *              the buddy block needs to be calculated. This structure should
+ *              contain details such as the block's address or index.
+ * 
+ * @return A pointer to the structure representing the calculated buddy block.
+ *         This structure will contain the details of the buddy block, such as
+ *         its address or index.
+ *
+ * Instructions to implement:
+ * - Use the block's address or index to determine its buddy block.
+ * - Ensure the calculation adheres to the buddy memory allocation algorithm.
+ * - Validate the input parameters to ensure they are not NULL and are within
+ *   the bounds of the memory pool.
+ * - Return the calculated buddy block structure or handle errors appropriately
+ *   if the calculation fails.
+ */
+struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
+{
+    assert(pool != NULL);
+    assert(buddy != NULL);
+
+    // Calculate the offset of the buddy block
+    size_t block_offset = (unsigned char *)buddy - (unsigned char *)pool->base;
+
+    // Calculate the size of the block using its kval
+    size_t block_size = UINT64_C(1) << buddy->kval;
+
+    // XOR the block offset with the block size to find the buddy's offset
+    size_t buddy_offset = block_offset ^ block_size;
+
+    // Return the pointer to the buddy block
+    return (struct avail *)((unsigned char *)pool->base + buddy_offset);
+}
+
+/**
+ * Allocates a block of memory from the buddy memory pool.
+ *
+ * This function implements the buddy memory allocation algorithm, which is 
+ * designed to efficiently allocate and free memory blocks of sizes that are 
+ * powers of two. It takes a pointer to a buddy memory pool and the requested 
+ * size of memory to allocate.
+ *
+ * Instructions to implement this function:
+ * 1. Validate the input parameters:
+ *    - Ensure the `pool` pointer is not NULL.
+ *    - Ensure the requested `size` is greater than zero.
+ * 2. Adjust the requested size to the nearest power of two that can accommodate it.
+ * 3. Traverse the buddy memory pool to find a free block of the appropriate size:
+ *    - If a larger block is found, split it into smaller blocks until the desired size is reached.
+ *    - Mark the allocated block as used.
+ * 4. Return a pointer to the allocated memory block.
+ * 5. If no suitable block is available, return NULL to indicate allocation failure.
+ *
+ * Parameters:
+ * - pool: A pointer to the buddy memory pool from which memory is to be allocated.
+ * - size: The size of the memory block to allocate (in bytes).
+ *
+ * Returns:
+ * - A pointer to the allocated memory block on success.
+ * - NULL if the allocation fails due to insufficient memory or invalid input.
+ *
+ * Notes:
+ * - Ensure thread safety if the buddy memory pool is accessed concurrently.
+ * - Consider implementing coalescing of adjacent free blocks during deallocation
+ *   to optimize memory usage.
+ * - Handle edge cases, such as alignment requirements and minimum block sizes.
+ */
+void *buddy_malloc(struct buddy_pool *pool, size_t size)
+{
+    if (pool == NULL) {
+        fprintf(stderr, "Error: Null pointer passed as pool to buddy_malloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (size == 0) {
+        fprintf(stderr, "Error: Invalid size (0) passed to buddy_malloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Check if the requested size exceeds the size the pool can grow to
+    if (!size_fits(pool, size)) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Add header size to the requested size
+    size_t requested = size;
+    size += buddy_hdr_size(pool);
+
+    // Get the kval for the requested size, never handing out less than the
+    // smallest block that can hold the avail header once it is freed
+    size_t kval = btok(size);
+    if (kval < SMALLEST_K)
+    {
+        kval = SMALLEST_K;
+    }
+
+    struct avail *block = alloc_block(pool, kval);
+    if (block != NULL)
+    {
+        stats_alloc(pool, requested, kval, 1);
+        return (void *)((unsigned char *)block + buddy_hdr_size(pool));
+    }
+
+    // No suitable block found
+    stats_fail(pool);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/**
+* @brief Zero len bytes at mem. Whole pages inside a large range are dropped
+* instead, falling back to memset where the kernel refuses.
+*/
+static void zero_range(struct buddy_pool *pool, unsigned char *mem, size_t len)
+{
+    if (len >= BUDDY_CALLOC_RELEASE)
+    {
+        uintptr_t page = pool->page_size;
+        unsigned char *first = (unsigned char *)(((uintptr_t)mem + page - 1) & ~(page - 1));
+        unsigned char *last = (unsigned char *)(((uintptr_t)mem + len) & ~(page - 1));
+        if (first < last && madvise(first, (size_t)(last - first), MADV_DONTNEED) == 0)
+        {
+            memset(mem, 0, (size_t)(first - mem));
+            memset(last, 0, (size_t)(mem + len - last));
+            return;
+        }
+    }
+    memset(mem, 0, len);
+}
+
+void *buddy_calloc(struct buddy_pool *pool, size_t nmemb, size_t size)
+{
+    if (pool == NULL) {
+        fprintf(stderr, "Error: Null pointer passed as pool to buddy_calloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t total = nmemb * size;
+    if (total == 0 || !size_fits(pool, total)) {
+        return buddy_malloc(pool, total);
+    }
+
+    size_t kval = size_kval(pool, total);
+    struct avail *block = alloc_block(pool, kval);
+    if (block == NULL) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    stats_alloc(pool, total, kval, 1);
+
+    // Everything from the clean offset on is zero already
+    size_t end = buddy_hdr_size(pool) + total;
+    if (block->clean != 0 && block->clean < end)
+    {
+        end = block->clean;
+    }
+    unsigned char *mem = (unsigned char *)block + buddy_hdr_size(pool);
+    if (end > buddy_hdr_size(pool))
+    {
+        zero_range(pool, mem, end - buddy_hdr_size(pool));
+    }
+    return mem;
+}
+
+void *buddy_malloc_at_least(struct buddy_pool *pool, size_t size, size_t *actual)
+{
+    void *mem = buddy_malloc(pool, size);
+    if (mem != NULL && actual != NULL)
+    {
+        *actual = (UINT64_C(1) << size_kval(pool, size)) - buddy_hdr_size(pool);
+    }
+    return mem;
+}
+
+/**
+* @brief Find the kval of an allocated block in a BUDDY_NOHEADER pool by
+* looking for its bit in the alloc bitmaps, smallest class first.
+*
+* @return The kval or 0 when no class has the block allocated
+*/
+static size_t nohdr_kval(struct buddy_pool *pool, struct avail *block)
+{
+    size_t offset = (size_t)((unsigned char *)block - (unsigned char *)pool->base);
+    for (size_t k = SMALLEST_K; k <= pool->kval_max; k++)
+    {
+        if (offset & ((UINT64_C(1) << k) - 1))
+        {
+            break;
+        }
+        if (map_test(pool->alloc_map[k], offset >> k))
+        {
+            return k;
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Map a user pointer back to its block, validating that it is a block
+* handed out by buddy_malloc. Errors are reported on behalf of fn, or not at
+* all when fn is NULL.
+*
+* @param kval Set to the kval of the block on success
+* @return The block or NULL if ptr is not a valid allocation
+*/
+static struct avail *ptr_to_block(struct buddy_pool *pool, void *ptr, const char *fn, size_t *kval)
+{
+    // Calculate the address of the block header
+    struct avail *block = (struct avail *)((unsigned char *)ptr - buddy_hdr_size(pool));
+
+    // Validate that the block is within the pool's memory range
+    if ((unsigned char *)block < (unsigned char *)pool->base || 
+        (unsigned char *)block >= (unsigned char *)pool->base + pool_numbytes(pool)) {
+        if (fn) fprintf(stderr, "Error: Pointer is out of bounds in %s.\n", fn);
+        return NULL;
+    }
+
+    // buddy_aligned_alloc leaves a shim header in front of the user pointer
+    // that records how far back the real block starts
+    if (!(pool->flags & BUDDY_NOHEADER) && block->tag == BLOCK_ALIGNED) {
+        size_t gap = UINT64_C(1) << block->kval;
+        if (block->kval >= MAX_K || gap > (size_t)((unsigned char *)ptr - (unsigned char *)pool->base)) {
+            if (fn) fprintf(stderr, "Error: Pointer was not allocated by buddy_malloc in %s.\n", fn);
+            return NULL;
+        }
+        block = (struct avail *)((unsigned char *)ptr - gap);
+    }
+
+    if (pool->flags & BUDDY_NOHEADER) {
+        *kval = nohdr_kval(pool, block);
+        if (*kval == 0) {
+            if (fn) fprintf(stderr, "Error: Pointer was not allocated by buddy_malloc in %s.\n", fn);
+            return NULL;
+        }
+        return block;
+    }
+
+    // Only blocks handed out by buddy_malloc can be freed
+    if (block->tag != BLOCK_RESERVED || block->kval < SMALLEST_K || block->kval > pool->kval_max ||
+        (size_t)((unsigned char *)ptr - (unsigned char *)block) >= (UINT64_C(1) << block->kval)) {
+        if (fn) fprintf(stderr, "Error: Pointer was not allocated by buddy_malloc in %s.\n", fn);
+        return NULL;
+    }
+
+    // Validate that the block is aligned to its own block size
+    if (((unsigned char *)block - (unsigned char *)pool->base) % (UINT64_C(1) << block->kval) != 0) {
+        if (fn) fprintf(stderr, "Error: Pointer is not aligned to its block size in %s.\n", fn);
+        return NULL;
+    }
+    *kval = block->kval;
+    return block;
+}
+
+
+size_t buddy_block_kval(struct buddy_pool *pool, void *ptr)
+{
+    size_t kval = 0;
+    if (pool == NULL || ptr == NULL || ptr_to_block(pool, ptr, NULL, &kval) == NULL)
+    {
+        return 0;
+    }
+    return kval;
+}
+
+size_t buddy_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    size_t kval = 0;
+    if (pool == NULL || ptr == NULL)
+    {
+        return 0;
+    }
+    struct avail *block = ptr_to_block(pool, ptr, NULL, &kval);
+    if (block == NULL)
+    {
+        return 0;
+    }
+    return (UINT64_C(1) << kval) - (size_t)((unsigned char *)ptr - (unsigned char *)block);
+}
+
+/**
+ * Frees a previously allocated memory block in the buddy memory pool.
+ *
+ * This function is responsible for returning a memory block, identified by 
+ * the pointer `ptr`, back to the buddy memory pool `pool`. It should:
+ * 
+ * 1. Validate the input parameters to ensure `ptr` is within the bounds of 
+ *    the memory pool and that `pool` is not NULL.
+ * 2. Determine the size of the block being freed based on the buddy system 
+ *    allocation rules.
+ * 3. Mark the block as free in the buddy system's internal data structures.
+ * 4. Coalesce adjacent free blocks, if possible, to maintain the buddy system's 
+ *    efficiency and reduce fragmentation.
+ * 
+ * Proper error handling should be implemented to handle invalid inputs or 
+ * inconsistencies in the memory pool's state.
+ *
+ * @param pool A pointer to the buddy memory pool structure.
+ * @param ptr  A pointer to the memory block to be freed.
+ */
+void buddy_free(struct buddy_pool *pool, void *ptr)
+{
+    if (pool == NULL || ptr == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_free.\n");
+        return;
+    }
+
+    size_t kval;
+    struct avail *block = ptr_to_block(pool, ptr, "buddy_free", &kval);
+    if (block == NULL) {
+        return;
+    }
+
+    if (remote_free(pool)) {
+        remote_kval(pool, block, kval);
+        remote_push(pool, block, block);
+        return;
+    }
+    stats_free(pool, kval);
+    free_block(pool, block, kval, 0);
+}
+
+
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (pool == NULL || ptr == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_free_sized.\n");
+        return;
+    }
+
+    if (!size_fits(pool, size)) {
+        fprintf(stderr, "Error: Size too large for the pool passed to buddy_free_sized.\n");
+        return;
+    }
+
+    size_t kval = size_kval(pool, size);
+    struct avail *block = (struct avail *)((unsigned char *)ptr - buddy_hdr_size(pool));
+    assert((pool->flags & BUDDY_NOHEADER) ?
+        map_test(pool->alloc_map[kval], map_index(pool, block, kval)) :
+        (block->tag == BLOCK_RESERVED && block->kval == kval));
+    if (remote_free(pool)) {
+        remote_kval(pool, block, kval);
+        remote_push(pool, block, block);
+        return;
+    }
+    stats_free(pool, kval);
+    free_block(pool, block, kval, 0);
+}
+
+
+
+size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out)
+{
+    if (pool == NULL || size == 0) {
+        fprintf(stderr, "Error: Invalid arguments passed to buddy_malloc_batch.\n");
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (!size_fits(pool, size)) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t requested = size;
+    size_t kval = size_kval(pool, size);
+
+    size_t done = 0;
+    while (done < n)
+    {
+        // Ask for a block holding the largest power of two of the blocks
+        // still needed, settling for smaller groups when there is none
+        size_t group = kval + btok((n - done) / 2 + 1);
+        if (group > pool->kval_max)
+        {
+            group = pool->kval_max;
+        }
+        // Only the last resort may compact or make a reserved pool grow,
+        // larger groups are just taken when a free block is there
+        struct avail *block = NULL;
+        while (group > kval)
+        {
+            size_t found;
+            block = take_block(pool, group, &found);
+            if (block != NULL)
+            {
+                block = split_block(pool, block, found, group);
+                break;
+            }
+            group--;
+        }
+        if (block == NULL)
+        {
+            block = alloc_block(pool, kval);
+        }
+        if (block == NULL)
+        {
+            stats_fail(pool);
+            errno = ENOMEM;
+            break;
+        }
+
+        // Cut the group into siblings of kval
+        blk_unreserve(pool, block, group);
+        size_t count = UINT64_C(1) << (group - kval);
+        stats_alloc(pool, requested, kval, count);
+        for (size_t i = 0; i < count; i++)
+        {
+            struct avail *sibling = (struct avail *)((unsigned char *)block + (i << kval));
+            blk_reserve(pool, sibling, kval);
+            out[done++] = (unsigned char *)sibling + buddy_hdr_size(pool);
+        }
+    }
+    return done;
+}
+
+
+/**
+* @brief Order pointers by address for buddy_free_batch
+*/
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t n)
+{
+    if (pool == NULL || ptrs == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_free_batch.\n");
+        return;
+    }
+
+    // Another thread's batch goes onto the owner's queue as one chain
+    if (remote_free(pool))
+    {
+        struct avail *first = NULL;
+        struct avail *last = NULL;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t kval;
+            struct avail *block = ptrs[i] == NULL ? NULL :
+                ptr_to_block(pool, ptrs[i], "buddy_free_batch", &kval);
+            if (block == NULL)
+            {
+                continue;
+            }
+            remote_kval(pool, block, kval);
+            block->next = first;
+            first = block;
+            if (last == NULL)
+            {
+                last = block;
+            }
+        }
+        if (first != NULL)
+        {
+            remote_push(pool, first, last);
+        }
+        return;
+    }
+
+    // Batches from buddy_malloc_batch usually come back in order already
+    for (size_t i = 1; i < n; i++)
+    {
+        if ((uintptr_t)ptrs[i - 1] > (uintptr_t)ptrs[i])
+        {
+            qsort(ptrs, n, sizeof(void *), ptr_cmp);
+            break;
+        }
+    }
+
+    // Walk the blocks in address order keeping a stack of merged blocks in
+    // the front of ptrs. A block is the upper buddy of the top of the stack
+    // exactly when the two can merge, and the merged block may in turn be
+    // the upper buddy of the entry below. The blocks are ours until they
+    // reach the free lists, so the kval of each stack entry is kept in its
+    // header even in a BUDDY_NOHEADER pool.
+    size_t top = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ptrs[i] == NULL)
+        {
+            continue;
+        }
+        size_t kval;
+        struct avail *block = ptr_to_block(pool, ptrs[i], "buddy_free_batch", &kval);
+        if (block == NULL)
+        {
+            continue;
+        }
+        stats_free(pool, kval);
+        blk_unreserve(pool, block, kval);
+        while (top > 0)
+        {
+            struct avail *lower = ptrs[top - 1];
+            size_t offset = (size_t)((unsigned char *)lower - (unsigned char *)pool->base);
+            if (lower->kval != kval || (offset & (UINT64_C(1) << kval)) != 0 ||
+                (unsigned char *)lower + (UINT64_C(1) << kval) != (unsigned char *)block)
+            {
+                break;
+            }
+            block = lower;
+            kval++;
+            top--;
+        }
+        hdr_store(block, BLOCK_RESERVED, kval);
+        ptrs[top++] = block;
+    }
+
+    for (size_t i = 0; i < top; i++)
+    {
+        struct avail *block = ptrs[i];
+        free_block(pool, block, block->kval, 0);
+    }
+}
+
+
+/**
+* @brief Move an allocation with old_size usable bytes at ptr to a new block
+* of size bytes. The old block is left untouched on failure.
+*/
+static void *realloc_move(struct buddy_pool *pool, void *ptr, size_t size, size_t old_size)
+{
+    void *mem = buddy_malloc(pool, size);
+    if (mem == NULL) {
+        return NULL;
+    }
+    memcpy(mem, ptr, old_size < size ? old_size : size);
+    buddy_free(pool, ptr);
+    return mem;
+}
+
+/**
+* @brief This is a simple version of realloc.
+*
+* Shrinking always happens in place by handing the upper halves of the block
+* back to the free lists. Growing happens in place when the block is the
+* lower buddy at every level up to the new size and each upper buddy is free
+* with a matching kval. Only when that fails is the data copied.
+*
+* @param poolThe memory pool
+* @param ptr The user memory
+* @param size the new size requested
+* @return void* pointer to the new user memory
+*/
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return buddy_malloc(pool, size);
+    }
+
+    if (pool == NULL) {
+        fprintf(stderr, "Error: Null pointer passed as pool to buddy_realloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (size == 0) {
+        buddy_free(pool, ptr);
+        return NULL;
+    }
+
+    size_t old_kval;
+    struct avail *block = ptr_to_block(pool, ptr, "buddy_realloc", &old_kval);
+    if (block == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!size_fits(pool, size)) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t kval = size_kval(pool, size);
+
+    // Only blocks that start right after the header can be resized in place.
+    // An aligned allocation keeps its block while the new size still fits
+    // behind ptr and moves otherwise.
+    size_t gap = (size_t)((unsigned char *)ptr - (unsigned char *)block);
+    size_t old_size = (UINT64_C(1) << old_kval) - gap;
+    if (gap != buddy_hdr_size(pool))
+    {
+        return size <= old_size ? ptr : realloc_move(pool, ptr, size, old_size);
+    }
+    size_t cur = old_kval;
+
+    // Shrink in place, the upper halves can never coalesce because their
+    // buddy is the block we are keeping
+    while (cur > kval)
+    {
+        cur--;
+        struct avail *tail = (struct avail *)((unsigned char *)block + (UINT64_C(1) << cur));
+        size_t clean = blk_decommit(pool, tail, cur) ? pool->page_size : 0;
+        blk_publish(pool, tail, cur, clean);
+    }
+
+    // Grow in place while we are the lower buddy and the upper buddy is free
+    size_t offset = (size_t)((unsigned char *)block - (unsigned char *)pool->base);
+    while (cur < kval && cur < pool_kval_m(pool) && (offset & (UINT64_C(1) << cur)) == 0)
+    {
+        struct avail *buddy = (struct avail *)((unsigned char *)block + (UINT64_C(1) << cur));
+        if (!blk_claim(pool, buddy, cur))
+        {
+            break;
+        }
+        cur++;
+    }
+    if (cur == kval)
+    {
+        if (cur != old_kval)
+        {
+            blk_unreserve(pool, block, old_kval);
+            blk_reserve(pool, block, cur);
+            stats_resize(pool, old_kval, cur, size);
+        }
+        return ptr;
+    }
+
+    // Fell short, hand the buddies claimed so far back before moving. Their
+    // buddy is still our block, so they go back without coalescing.
+    while (cur > old_kval)
+    {
+        cur--;
+        struct avail *buddy = (struct avail *)((unsigned char *)block + (UINT64_C(1) << cur));
+        blk_publish(pool, buddy, cur, buddy->clean);
+    }
+    return realloc_move(pool, ptr, size, old_size);
+}
+
+
+/**
+* @brief Allocate size bytes aligned to align.
+*
+* Blocks are aligned to their own size, and the pool base is aligned to the
+* pool size, so a header free pool just picks a class of at least align. With
+* headers the user data starts at the first align boundary past the header,
+* which is block + align, and a shim header right in front of it points back
+* at the block.
+*/
+void *buddy_aligned_alloc(struct buddy_pool *pool, size_t align, size_t size)
+{
+    if (pool == NULL) {
+        fprintf(stderr, "Error: Null pointer passed as pool to buddy_aligned_alloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (size == 0 || align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Every block is at least this aligned already
+    size_t natural = (pool->flags & BUDDY_NOHEADER) ? (UINT64_C(1) << SMALLEST_K) : buddy_hdr_size(pool);
+    if (align <= natural) {
+        return buddy_malloc(pool, size);
+    }
+
+    // The base is only page aligned if it could not be mapped at its natural
+    // alignment, blocks can not be more aligned than that
+    if (((uintptr_t)pool->base & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t gap = (pool->flags & BUDDY_NOHEADER) ? 0 : align;
+    if (size > (UINT64_C(1) << pool->kval_max) - gap || align > (UINT64_C(1) << pool->kval_max)) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t kval = btok(size + gap);
+    if (kval < btok(align))
+    {
+        kval = btok(align);
+    }
+    if (kval < SMALLEST_K)
+    {
+        kval = SMALLEST_K;
+    }
+
+    struct avail *block = alloc_block(pool, kval);
+    if (block == NULL) {
+        stats_fail(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    stats_alloc(pool, size, kval, 1);
+    unsigned char *ptr = (unsigned char *)block + gap;
+    if (gap != 0)
+    {
+        struct buddy_header *shim = (struct buddy_header *)ptr - 1;
+        shim->tag = BLOCK_ALIGNED;
+        shim->kval = (unsigned short)btok(align);
+    }
+    return ptr;
+}
+
+
+/**
+* @brief Map bytes (a power of two) of memory aligned to align, so that every
+* block is aligned to its size in absolute terms and not just relative to
+* base. bytes + align is mapped and the excess trimmed. If that much address
+* space is not available an ordinary mapping of bytes is used.
+*/
+static void *map_aligned(size_t bytes, size_t align, int prot, int extra)
+{
+    unsigned char *raw = mmap(
+    NULL, /*addr to map to*/
+    bytes + align, /*length*/
+    prot, /*prot*/
+    MAP_PRIVATE | MAP_ANONYMOUS | extra, /*flags*/
+    -1, /*fd -1 when using MAP_ANONYMOUS*/
+    0 /* offset 0 when using MAP_ANONYMOUS*/
+    );
+    if (MAP_FAILED == raw)
+    {
+        return mmap(NULL, bytes, prot, MAP_PRIVATE | MAP_ANONYMOUS | extra, -1, 0);
+    }
+    unsigned char *start = (unsigned char *)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    size_t head = (size_t)(start - raw);
+    if (head > 0)
+    {
+        munmap(raw, head);
+    }
+    if (align - head > 0)
+    {
+        munmap(start + bytes, align - head);
+    }
+    return start;
+}
+
+#ifdef MAP_HUGETLB
+/**
+* @brief Map bytes of hugetlb memory aligned to bytes. Hugetlb pages are
+* committed when mapped, so the aligned range is reserved without access
+* first and only bytes of huge pages are mapped over it with MAP_FIXED.
+*/
+static void *map_huge(size_t bytes, int extra)
+{
+    void *range = map_aligned(bytes, bytes, PROT_NONE, MAP_NORESERVE);
+    if (MAP_FAILED == range)
+    {
+        return MAP_FAILED;
+    }
+    void *mem = mmap(range, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | extra, -1, 0);
+    if (MAP_FAILED == mem)
+    {
+        munmap(range, bytes);
+    }
+    return mem;
+}
+#endif
+
+/**
+* @brief Map the memory for a pool of kval according to its huge page flags,
+* falling back from hugetlb to THP to normal pages. The flags that could not
+* be honoured are cleared and page_size is set to the granule the mapping is
+* backed with.
+*
+* A pool that may grow to kval_max reserves that address space without access
+* or swap reservation and only commits the first 2^kval bytes. When the
+* address space is not there the reservation is halved until it fits and
+* pool->kval_max lowered to match. Such a pool can not use hugetlb pages,
+* which are committed when mapped, and gets THP instead.
+*/
+static void *map_pool(struct buddy_pool *pool, size_t kval, size_t kval_max)
+{
+    size_t bytes = UINT64_C(1) << kval;
+    if (kval_max > kval)
+    {
+        if (pool->flags & (BUDDY_HUGETLB | BUDDY_HUGETLB_1G))
+        {
+            pool->flags &= ~(unsigned int)(BUDDY_HUGETLB | BUDDY_HUGETLB_1G);
+            pool->flags |= BUDDY_THP;
+        }
+        void *mem = MAP_FAILED;
+        for (; kval_max >= kval && MAP_FAILED == mem; kval_max--)
+        {
+            size_t reserve = UINT64_C(1) << kval_max;
+            mem = map_aligned(reserve, reserve, PROT_NONE, MAP_NORESERVE);
+            pool->kval_max = kval_max;
+        }
+        if (MAP_FAILED == mem || mprotect(mem, bytes, PROT_READ | PROT_WRITE) != 0)
+        {
+            return MAP_FAILED;
+        }
+#ifdef MADV_HUGEPAGE
+        if ((pool->flags & BUDDY_THP) && madvise(mem, bytes, MADV_HUGEPAGE) == 0)
+        {
+            return mem;
+        }
+#endif
+        pool->flags &= ~(unsigned int)BUDDY_THP;
+        return mem;
+    }
+#ifdef MAP_HUGETLB
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+    size_t huge_k = (pool->flags & BUDDY_HUGETLB_1G) ? 30 : 21;
+    if ((pool->flags & (BUDDY_HUGETLB | BUDDY_HUGETLB_1G)) && kval >= huge_k)
+    {
+        void *mem = map_huge(bytes, (int)(huge_k << MAP_HUGE_SHIFT));
+        if (MAP_FAILED != mem)
+        {
+            pool->page_size = UINT64_C(1) << huge_k;
+            return mem;
+        }
+    }
+#endif
+    if (pool->flags & (BUDDY_HUGETLB | BUDDY_HUGETLB_1G))
+    {
+        pool->flags &= ~(unsigned int)(BUDDY_HUGETLB | BUDDY_HUGETLB_1G);
+        pool->flags |= BUDDY_THP;
+    }
+    if (!(pool->flags & BUDDY_THP))
+    {
+        return map_aligned(bytes, bytes, PROT_READ | PROT_WRITE, 0);
+    }
+    //Align to at least one huge page so the pool can be fully backed by them
+    size_t thp = UINT64_C(1) << 21;
+    void *mem = map_aligned(bytes, bytes > thp ? bytes : thp, PROT_READ | PROT_WRITE, 0);
+#ifdef MADV_HUGEPAGE
+    if (MAP_FAILED != mem && madvise(mem, bytes, MADV_HUGEPAGE) == 0)
+    {
+        return mem;
+    }
+#endif
+    pool->flags &= ~(unsigned int)BUDDY_THP;
+    return mem;
 }
 
-/**
- * Allocates a block of memory from the buddy memory pool.
- *
- * This function implements the buddy memory allocation algorithm, which is 
- * designed to efficiently allocate and free memory blocks of sizes that are 
- * powers of two. It takes a pointer to a buddy memory pool and the requested 
- * size of memory to allocate.
- *
- * Instructions to implement this function:
- * 1. Validate the input parameters:
- *    - Ensure the `pool` pointer is not NULL.
- *    - Ensure the requested `size` is greater than zero.
- * 2. Adjust the requested size to the nearest power of two that can accommodate it.
- * 3. Traverse the buddy memory pool to find a free block of the appropriate size:
- *    - If a larger block is found, split it into smaller blocks until the desired size is reached.
- *    - Mark the allocated block as used.
- * 4. Return a pointer to the allocated memory block.
- * 5. If no suitable block is available, return NULL to indicate allocation failure.
- *
- * Parameters:
- * - pool: A pointer to the buddy memory pool from which memory is to be allocated.
- * - size: The size of the memory block to allocate (in bytes).
- *
- * Returns:
- * - A pointer to the allocated memory block on success.
- * - NULL if the allocation fails due to insufficient memory or invalid input.
- *
- * Notes:
- * - Ensure thread safety if the buddy memory pool is accessed concurrently.
- * - Consider implementing coalescing of adjacent free blocks during deallocation
- *   to optimize memory usage.
- * - Handle edge cases, such as alignment requirements and minimum block sizes.
- */
-void *buddy_malloc(struct buddy_pool *pool, size_t size)
+
+int buddy_set_decommit(struct buddy_pool *pool, size_t threshold, int advice)
 {
-    if (pool == NULL) {
-        fprintf(stderr, "Error: Null pointer passed as pool to buddy_malloc.\n");
+    if (pool == NULL || (advice != MADV_DONTNEED && advice != MADV_FREE))
+    {
         errno = EINVAL;
-        return NULL;
+        return -1;
     }
-
-    if (size == 0) {
-        fprintf(stderr, "Error: Invalid size (0) passed to buddy_malloc.\n");
-        errno = EINVAL;
-        return NULL;
+    if (threshold == 0)
+    {
+        pool->decommit_k = 0;
+        return 0;
     }
+    //A block needs a page beyond the one holding its links to be worth it
+    size_t kval = btok(threshold);
+    if (kval <= btok(pool->page_size))
+    {
+        kval = btok(pool->page_size) + 1;
+    }
+    pool->decommit_advice = advice;
+    pool->decommit_k = kval;
+    return 0;
+}
 
-    // Add header size to the requested size
-    size += sizeof(struct avail);
 
-    // Check if the requested size exceeds the total pool size
-    if (size > (UINT64_C(1) << pool->kval_m)) {
-        errno = ENOMEM;
-        return NULL;
+void buddy_set_lazy(struct buddy_pool *pool, size_t kval, size_t watermark)
+{
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        if (kval == 0 || k == kval)
+        {
+            pool->lazy_max[k] = watermark;
+        }
     }
-
-    // Get the kval for the requested size
-    //should check of this will give me an error
-    size_t kval = MIN_K;
-    while ((UINT64_C(1) << kval) < size)
+    pool->flags &= ~(unsigned int)BUDDY_LAZY;
+    for (size_t k = 0; k < MAX_K; k++)
     {
-        kval++;
+        if (pool->lazy_max[k] != 0)
+        {
+            pool->flags |= BUDDY_LAZY;
+        }
     }
+}
+
 
-    if (kval < SMALLEST_K && pool->kval_m < SMALLEST_K)
+size_t buddy_compact(struct buddy_pool *pool)
+{
+    if (pool == NULL)
     {
-        kval = SMALLEST_K;
+        return 0;
     }
+    return compact(pool);
+}
 
-    // Find a block
-    for (size_t i = kval; i <= pool->kval_m; i++)
-    {
-        if (pool->avail[i].next != &pool->avail[i])
-        {
-            // Remove from list
-            struct avail *block = pool->avail[i].next;
-            block->prev->next = block->next;
-            block->next->prev = block->prev;
 
-            // Check if the block size matches the entire pool size
-            if (i == pool->kval_m) {
-                block->tag = BLOCK_RESERVED; // Mark as reserved if it matches the entire pool size
-            } else {
-                block->tag = BLOCK_USED; // Mark as used for other cases
-            }
+void buddy_set_owner(struct buddy_pool *pool)
+{
+    pool->owner = pthread_self();
+}
 
-            // Set block kval BEFORE splitting (even if not splitting)
-            block->kval = i;
 
-            // Split required?
-            while (i > kval && i > MIN_K)
-            {
-                i--;
-                size_t block_size = UINT64_C(1) << i;
-                struct avail *buddy = (struct avail *)((unsigned char *)block + block_size);
-
-                // Split the block
-                buddy->tag = BLOCK_AVAIL;
-                buddy->kval = i;
-                buddy->next = &pool->avail[i];
-                buddy->prev = pool->avail[i].prev;
-                pool->avail[i].prev->next = buddy;
-                pool->avail[i].prev = buddy;
-
-                block->kval = i;
-            }
+size_t buddy_drain_remote(struct buddy_pool *pool)
+{
+    if (pool == NULL || !(pool->flags & BUDDY_REMOTE_FREE))
+    {
+        return 0;
+    }
+    return remote_drain(pool);
+}
 
-            // Check if the block size matches the entire pool size
-            if (i == pool->kval_m) {
-                block->tag = BLOCK_RESERVED; // Mark as reserved if it matches the entire pool size
-            } else {
-                block->tag = BLOCK_USED; // Mark as used for other cases
-            }
-            
-            // Ensure the block's tag is consistent before returning
-            assert(block->tag == BLOCK_RESERVED || block->tag == BLOCK_USED);
-            return (void *)((unsigned char *)block + sizeof(struct avail));
+
+void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out)
+{
+    memset(out, 0, sizeof(struct buddy_stats));
+    for (size_t i = 0; i <= BUDDY_STATS_SLOTS; i++)
+    {
+        struct buddy_stats_slot *slot = i == BUDDY_STATS_SLOTS ? &pool->stats_shared :
+            pool->stats == NULL ? NULL : &pool->stats[i];
+        if (slot == NULL)
+        {
+            continue;
         }
+        out->allocs += __atomic_load_n(&slot->allocs, __ATOMIC_RELAXED);
+        out->frees += __atomic_load_n(&slot->frees, __ATOMIC_RELAXED);
+        out->failed += __atomic_load_n(&slot->failed, __ATOMIC_RELAXED);
+        out->bytes_requested += __atomic_load_n(&slot->requested, __ATOMIC_RELAXED);
+        out->bytes_granted += __atomic_load_n(&slot->granted, __ATOMIC_RELAXED);
+    }
+    out->bytes_in_use = stats_in_use(pool);
+    out->peak_bytes_in_use = __atomic_load_n(&pool->stats_peak, __ATOMIC_RELAXED);
+    if (out->peak_bytes_in_use < out->bytes_in_use)
+    {
+        out->peak_bytes_in_use = out->bytes_in_use;
+    }
+    out->pool_bytes = pool_numbytes(pool);
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        out->free_blocks[k] = __atomic_load_n(&pool->nfree[k], __ATOMIC_RELAXED);
+        out->bytes_free += out->free_blocks[k] << k;
+        out->splits[k] = __atomic_load_n(&pool->nsplit[k], __ATOMIC_RELAXED);
+        out->merges[k] = __atomic_load_n(&pool->nmerge[k], __ATOMIC_RELAXED);
     }
+}
 
-    // No suitable block found
-    errno = ENOMEM;
-    return NULL;
+
+size_t buddy_largest_free(struct buddy_pool *pool)
+{
+    uint64_t mask = mask_load(pool);
+    if (mask == 0)
+    {
+        return 0;
+    }
+    return (UINT64_C(1) << mask_top(mask)) - buddy_hdr_size(pool);
 }
 
-/**
- * Frees a previously allocated memory block in the buddy memory pool.
- *
- * This function is responsible for returning a memory block, identified by 
- * the pointer `ptr`, back to the buddy memory pool `pool`. It should:
- * 
- * 1. Validate the input parameters to ensure `ptr` is within the bounds of 
- *    the memory pool and that `pool` is not NULL.
- * 2. Determine the size of the block being freed based on the buddy system 
- *    allocation rules.
- * 3. Mark the block as free in the buddy system's internal data structures.
- * 4. Coalesce adjacent free blocks, if possible, to maintain the buddy system's 
- *    efficiency and reduce fragmentation.
- * 
- * Proper error handling should be implemented to handle invalid inputs or 
- * inconsistencies in the memory pool's state.
- *
- * @param pool A pointer to the buddy memory pool structure.
- * @param ptr  A pointer to the memory block to be freed.
- */
-void buddy_free(struct buddy_pool *pool, void *ptr)
+
+void buddy_fragmentation(struct buddy_pool *pool, struct buddy_frag *out)
 {
-    if (pool == NULL || ptr == NULL) {
-        fprintf(stderr, "Error: Null pointer passed to buddy_free.\n");
+    memset(out, 0, sizeof(struct buddy_frag));
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        out->bytes_free_by_class[k] = __atomic_load_n(&pool->nfree[k], __ATOMIC_RELAXED) << k;
+        out->bytes_free += out->bytes_free_by_class[k];
+        if (out->bytes_free_by_class[k] != 0)
+        {
+            out->largest_free = UINT64_C(1) << k;
+        }
+    }
+    if (out->bytes_free == 0)
+    {
         return;
     }
+    out->index = 1.0 - (double)out->largest_free / (double)out->bytes_free;
+    // Blocks below kval are the ones a request of kval can not use
+    size_t below = 0;
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        out->unusable[k] = (double)below / (double)out->bytes_free;
+        below += out->bytes_free_by_class[k];
+    }
+}
 
-    // Calculate the address of the block header
-    struct avail *block = (struct avail *)((unsigned char *)ptr - sizeof(struct avail));
 
-    // Validate that the block is within the pool's memory range
-    if ((unsigned char *)block < (unsigned char *)pool->base || 
-        (unsigned char *)block >= (unsigned char *)pool->base + pool->numbytes) {
-        fprintf(stderr, "Error: Pointer is out of bounds in buddy_free.\n");
-        return;
+void buddy_pool_lock(struct buddy_pool *pool)
+{
+    // Ascending like compact takes them
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        class_lock(pool, k);
     }
+}
 
-    // Validate that the pointer is aligned to the smallest block size
-    if (((unsigned char *)block - (unsigned char *)pool->base) % (UINT64_C(1) << MIN_K) != 0) {
-        fprintf(stderr, "Error: Pointer is not aligned to the smallest block size in buddy_free.\n");
-        return;
+
+void buddy_pool_unlock(struct buddy_pool *pool)
+{
+    for (size_t k = MAX_K; k > 0; k--)
+    {
+        class_unlock(pool, k - 1);
     }
+}
 
-    // Mark the block as available
-    block->tag = BLOCK_AVAIL;
 
-    // Coalesce adjacent free blocks
-    while (true)
+/**
+* @brief True when a block of exactly kval starts at offset, setting free to
+* whether it is free.
+*/
+static bool walk_block_at(struct buddy_pool *pool, size_t offset, size_t kval, bool *is_free)
+{
+    if (pool->flags & BUDDY_NOHEADER)
     {
-        // Calculate the buddy block
-        struct avail *buddy = buddy_calc(pool, block);
+        *is_free = map_test(pool->free_map[kval], offset >> kval);
+        return *is_free || map_test(pool->alloc_map[kval], offset >> kval);
+    }
+    struct avail *block = (struct avail *)((unsigned char *)pool->base + offset);
+    unsigned short tag = __atomic_load_n(&block->tag, __ATOMIC_RELAXED);
+    *is_free = tag == BLOCK_AVAIL;
+    return (tag == BLOCK_AVAIL || tag == BLOCK_RESERVED) &&
+        __atomic_load_n(&block->kval, __ATOMIC_RELAXED) == kval;
+}
 
-        // Check if the buddy block is free and has the same kval
-        if ((unsigned char *)buddy < (unsigned char *)pool->base || 
-            (unsigned char *)buddy >= (unsigned char *)pool->base + pool->numbytes || 
-            buddy->tag != BLOCK_AVAIL || buddy->kval != block->kval)
+/**
+* @brief Find the block that covers offset by looking at every aligned start
+* from the top class down; the first block found is the one holding offset.
+*
+* @return kval of the block, which starts at offset rounded down to it, or 0
+* if none was found because the block is changing hands
+*/
+static size_t walk_find(struct buddy_pool *pool, size_t offset, size_t top, bool *is_free)
+{
+    for (size_t k = top; k >= SMALLEST_K; k--)
+    {
+        if (walk_block_at(pool, offset & ~((UINT64_C(1) << k) - 1), k, is_free))
         {
-            break;
+            return k;
         }
+    }
+    return 0;
+}
 
-        // Remove the buddy block from its free list
-        buddy->prev->next = buddy->next;
-        buddy->next->prev = buddy->prev;
-
-        // Determine the lower address between the block and its buddy
-        if (buddy < block)
+/**
+* @brief kval of the block that starts at offset, 0 if there is none. Only
+* classes offset is aligned to can start there, smallest first like
+* nohdr_kval.
+*/
+static size_t walk_next(struct buddy_pool *pool, size_t offset, size_t top, bool *is_free)
+{
+    if (!(pool->flags & BUDDY_NOHEADER))
+    {
+        struct avail *block = (struct avail *)((unsigned char *)pool->base + offset);
+        size_t kval = __atomic_load_n(&block->kval, __ATOMIC_RELAXED);
+        if (kval < SMALLEST_K || kval > top || (offset & ((UINT64_C(1) << kval) - 1)) != 0)
         {
-            block = buddy;
+            return 0;
+        }
+        return walk_block_at(pool, offset, kval, is_free) ? kval : 0;
+    }
+    for (size_t k = SMALLEST_K; k <= top && (offset & ((UINT64_C(1) << k) - 1)) == 0; k++)
+    {
+        if (walk_block_at(pool, offset, k, is_free))
+        {
+            return k;
         }
-
-        // Increase the kval of the coalesced block
-        block->kval++;
     }
+    return 0;
+}
 
-    // Add the coalesced block back to the free list
-    block->next = pool->avail[block->kval].next;
-    block->prev = &pool->avail[block->kval];
-    pool->avail[block->kval].next->prev = block;
-    pool->avail[block->kval].next = block;
+bool buddy_walk_step(struct buddy_pool *pool, struct buddy_walk_cursor *cursor,
+    size_t max_blocks, buddy_walk_fn fn, void *ctx)
+{
+    bool lock = !(pool->flags & BUDDY_LOCKFREE);
+    if (lock)
+    {
+        buddy_pool_lock(pool);
+    }
+    size_t top = pool_kval_m(pool);
+    size_t end = UINT64_C(1) << top;
+    size_t offset = cursor->offset;
+    bool is_free;
+    size_t kval = 0;
+    for (size_t n = 0; n < max_blocks && offset < end && cursor->stopped == 0; n++)
+    {
+        // kval is 0 when offset may not be the start of a block: at the
+        // cursor, whose block may have merged with its lower buddy since the
+        // last step, or after a block that was changing hands
+        if (kval == 0)
+        {
+            kval = walk_find(pool, offset, top, &is_free);
+            if (kval == 0)
+            {
+                offset += UINT64_C(1) << SMALLEST_K;
+                continue;
+            }
+            size_t start = offset & ~((UINT64_C(1) << kval) - 1);
+            if (start != offset)
+            {
+                offset = start + (UINT64_C(1) << kval);
+                kval = 0;
+                continue;
+            }
+        }
+        cursor->stopped = fn(ctx, (unsigned char *)pool->base + offset, kval, is_free);
+        offset += UINT64_C(1) << kval;
+        kval = offset < end ? walk_next(pool, offset, top, &is_free) : 0;
+    }
+    if (lock)
+    {
+        buddy_pool_unlock(pool);
+    }
+    cursor->offset = offset;
+    return cursor->stopped == 0 && offset < end;
 }
 
 
+int buddy_walk(struct buddy_pool *pool, buddy_walk_fn fn, void *ctx)
+{
+    struct buddy_walk_cursor cursor = {0};
+    while (buddy_walk_step(pool, &cursor, BUDDY_WALK_STEP, fn, ctx))
+    {
+    }
+    return cursor.stopped;
+}
 
-/**
-* @brief This is a simple version of realloc.
-*
-* @param poolThe memory pool
-* @param ptr The user memory
-* @param size the new size requested
-* @return void* pointer to the new user memory
-*/
+
+void buddy_init(struct buddy_pool *pool, size_t size)
+{
+    buddy_init_flags(pool, size, 0);
+}
 
 
+void buddy_init_concurrent(struct buddy_pool *pool, size_t size)
+{
+    buddy_init_flags(pool, size, BUDDY_CONCURRENT);
+}
 
 
-void buddy_init(struct buddy_pool *pool, size_t size)
+/**
+* @brief Round a requested pool size to the kval buddy_init uses for it
+*/
+static size_t pool_size_kval(size_t size)
 {
     size_t kval = 0;
     if (size == 0)
@@ -340,54 +2325,139 @@ void buddy_init(struct buddy_pool *pool, size_t size)
     kval = btok(size);
     if (kval < MIN_K)
     kval = MIN_K;
-    if (kval > MAX_K)
+    if (kval >= MAX_K)
     kval = MAX_K - 1;
+    return kval;
+}
+
+
+void buddy_init_flags(struct buddy_pool *pool, size_t size, unsigned int flags)
+{
+    size_t kval = pool_size_kval(size);
+    buddy_init_reserve(pool, UINT64_C(1) << kval, UINT64_C(1) << kval, flags);
+}
+
+
+void buddy_init_reserve(struct buddy_pool *pool, size_t size, size_t max_size, unsigned int flags)
+{
+    size_t kval = pool_size_kval(size);
+    size_t kval_max = max_size == 0 ? MAX_K - 1 : pool_size_kval(max_size);
+    if (kval_max < kval)
+    kval_max = kval;
     //make sure pool struct is cleared out
     memset(pool,0,sizeof(struct buddy_pool));
+    if (flags & BUDDY_LOCKFREE)
+    {
+        flags |= BUDDY_CONCURRENT | BUDDY_NOHEADER;
+    }
     pool->kval_m = kval;
+    pool->kval_max = kval_max;
     pool->numbytes = (UINT64_C(1) << pool->kval_m);
+    pool->flags = flags;
+    pool->owner = pthread_self();
+    pool->stats_id = __atomic_add_fetch(&stats_ids, 1, __ATOMIC_RELAXED);
+    pool->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    pool->decommit_advice = MADV_DONTNEED;
+    if (flags & BUDDY_LAZY)
+    {
+        buddy_set_lazy(pool, 0, BUDDY_LAZY_DEFAULT);
+    }
+    if (flags & BUDDY_CONCURRENT)
+    {
+        for (size_t i = 0; i < MAX_K; i++)
+        {
+            pthread_mutex_init(&pool->locks[i], NULL);
+        }
+        //Every thread's counters on a cache line of their own
+        pool->stats = mmap(NULL, BUDDY_STATS_SLOTS * sizeof(struct buddy_stats_slot),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == pool->stats)
+        {
+            handle_error_and_die("buddy_init stats mmap failed");
+        }
+    }
     //Memory map a block of raw memory to manage
-    pool->base = mmap(
-    NULL, /*addr to map to*/
-    pool->numbytes, /*length*/
-    PROT_READ | PROT_WRITE, /*prot*/
-    MAP_PRIVATE | MAP_ANONYMOUS, /*flags*/
-    -1, /*fd -1 when using MAP_ANONYMOUS*/
-    0 /* offset 0 when using MAP_ANONYMOUS*/
-    );
+    pool->base = map_pool(pool, kval, kval_max);
     if (MAP_FAILED == pool->base)
     {
         handle_error_and_die("buddy_init avail array mmap failed");
     }
 
+    //A header free pool keeps a free and an alloc bitmap for every class
+    //in a separate mapping. Pages of it are only committed once touched, so
+    //the bitmaps cover everything the pool can grow to.
+    kval_max = pool->kval_max;
+    if (flags & BUDDY_NOHEADER)
+    {
+        size_t words = 0;
+        for (size_t i = SMALLEST_K; i <= kval_max; i++)
+        {
+            size_t n = ((UINT64_C(1) << (kval_max - i)) + 63) / 64;
+            words += 2 * n + ((flags & BUDDY_LOCKFREE) ? (n + 63) / 64 : 0);
+        }
+        pool->meta_bytes = words * sizeof(uint64_t);
+        pool->meta = mmap(NULL, pool->meta_bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == pool->meta)
+        {
+            handle_error_and_die("buddy_init bitmap mmap failed");
+        }
+        uint64_t *map = pool->meta;
+        for (size_t i = SMALLEST_K; i <= kval_max; i++)
+        {
+            size_t n = ((UINT64_C(1) << (kval_max - i)) + 63) / 64;
+            pool->free_map[i] = map;
+            pool->alloc_map[i] = map + n;
+            map += 2 * n;
+            if (flags & BUDDY_LOCKFREE)
+            {
+                pool->lf_summary[i] = map;
+                map += (n + 63) / 64;
+            }
+        }
+    }
+
     //Set all blocks to empty. We are using circular lists so the first elements
     //just point
     //to an available block. Thus the tag, and kval feild are unused burning a
     //small bit of
     //memory but making the code more readable. We mark these blocks as UNUSED to
     //aid in debugging.
-    for (size_t i = 0; i <= kval; i++)
+    for (size_t i = 0; i <= kval_max; i++)
     {
         pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
         pool->avail[i].kval = i;
         pool->avail[i].tag = BLOCK_UNUSED;
     }
     //Add in the first block
-    pool->avail[kval].next = pool->avail[kval].prev = (struct avail *)pool->base;
-    struct avail *m = pool->avail[kval].next;
-    m->tag = BLOCK_AVAIL;
-    m->kval = kval;
-    m->next = m->prev = &pool->avail[kval];
+    //Fresh anonymous memory reads as zero
+    blk_publish(pool, (struct avail *)pool->base, kval, sizeof(struct avail));
 }
 
 
 void buddy_destroy(struct buddy_pool *pool)
 {
-    int rval = munmap(pool->base, pool->numbytes);
+    int rval = munmap(pool->base, UINT64_C(1) << pool->kval_max);
     if (-1 == rval)
     {
         handle_error_and_die("buddy_destroy avail array");
     }
+    if (pool->meta != NULL && -1 == munmap(pool->meta, pool->meta_bytes))
+    {
+        handle_error_and_die("buddy_destroy bitmap");
+    }
+    if (pool->stats != NULL &&
+        -1 == munmap(pool->stats, BUDDY_STATS_SLOTS * sizeof(struct buddy_stats_slot)))
+    {
+        handle_error_and_die("buddy_destroy stats");
+    }
+    if (pool->flags & BUDDY_CONCURRENT)
+    {
+        for (size_t i = 0; i < MAX_K; i++)
+        {
+            pthread_mutex_destroy(&pool->locks[i]);
+        }
+    }
     //Zero out the array so it can be reused it needed
     memset(pool,0,sizeof(struct buddy_pool));
 }
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #ifdef __cplusplus
 extern "C"
 {
@@ -31,6 +32,67 @@ extern "C"
 #define BLOCK_AVAIL 1 /*Block is available to allocate*/
 #define BLOCK_RESERVED 0 /*Block has been handed to user*/
 #define BLOCK_UNUSED 3 /*Block is not used at all*/
+#define BLOCK_ALIGNED 2 /*Shim in front of buddy_aligned_alloc memory, kval is log2 of the distance back to the block*/
+/**
+* Flags accepted by buddy_init_flags.
+*/
+#define BUDDY_CONCURRENT 0x1 /*Pool may be used from several threads at once*/
+#define BUDDY_NOHEADER 0x2 /*Keep block state in side bitmaps instead of headers*/
+#define BUDDY_HUGETLB 0x4 /*Back the pool with explicit 2 MiB hugetlb pages*/
+#define BUDDY_HUGETLB_1G 0x8 /*Back the pool with explicit 1 GiB hugetlb pages*/
+#define BUDDY_THP 0x10 /*Align the pool to 2 MiB and ask for transparent huge pages*/
+#define BUDDY_LAZY 0x20 /*Defer coalescing, see buddy_set_lazy*/
+#define BUDDY_LOCKFREE 0x40 /*Lock-free malloc and free on the side bitmaps, implies BUDDY_CONCURRENT and BUDDY_NOHEADER*/
+#define BUDDY_REMOTE_FREE 0x80 /*Frees from threads other than the owner are queued for it, see buddy_set_owner*/
+/**
+* Free blocks each class keeps uncoalesced when a pool is created with
+* BUDDY_LAZY.
+*/
+#define BUDDY_LAZY_DEFAULT 32
+/**
+* Largest block size (2^BUDDY_CACHE_MAX_K) that a struct buddy_cache keeps in
+* its magazines. Bigger requests go straight to the pool.
+*/
+#define BUDDY_CACHE_MAX_K 16
+/**
+* Magazine depth used by buddy_cache_init when 0 is passed.
+*/
+#define BUDDY_CACHE_DEFAULT_DEPTH 32
+/**
+* buddy_calloc clears a dirty range of at least this many bytes by dropping
+* its pages with MADV_DONTNEED instead of writing zeros.
+*/
+#define BUDDY_CALLOC_RELEASE (UINT64_C(1) << 20)
+/**
+* Size of a slab (2^BUDDY_SLAB_K bytes), the buddy block a struct
+* buddy_slab_cache carves into equal objects.
+*/
+#define BUDDY_SLAB_K 16
+/**
+* Objects are rounded up to a multiple of BUDDY_SLAB_ALIGN bytes, giving one
+* slab class per multiple up to BUDDY_SLAB_MAX_SIZE. Larger requests go to
+* the pool.
+*/
+#define BUDDY_SLAB_ALIGN 16
+#define BUDDY_SLAB_MAX_SIZE 256
+#define BUDDY_SLAB_CLASSES (BUDDY_SLAB_MAX_SIZE / BUDDY_SLAB_ALIGN)
+/**
+* Most regions a struct buddy_arena can grow to.
+*/
+#define BUDDY_ARENA_MAX_REGIONS 64
+/**
+* Most nodes a struct buddy_numa keeps a pool for.
+*/
+#define BUDDY_NUMA_MAX_NODES 64
+/**
+* Threads that get counters of their own in a BUDDY_CONCURRENT pool, see
+* buddy_stats. Threads beyond that share one set.
+*/
+#define BUDDY_STATS_SLOTS 64
+/**
+* Blocks buddy_walk visits per step before letting other threads in.
+*/
+#define BUDDY_WALK_STEP 4096
 /**
 * Struct to represent the table of all available blocks do not reorder members
 * of this struct because internal calculations depend on the ordering.
@@ -42,11 +104,56 @@ struct avail
     unsigned short int tag; /*Tag for block status BLOCK_AVAIL,
     BLOCK_RESERVED*/
     unsigned short int kval; /*The kval of this block*/
+    unsigned int clean; /*Bytes from this offset to the end of the block are zero, 0 if unknown*/
     struct avail *next; /*next memory block*/
     struct avail *prev; /*prev memory block*/
 };
 
 
+/**
+* Header kept at the start of a block while it is handed out to the user.
+* Only free blocks need the list links of struct avail, so an allocated block
+* gives up just these 8 bytes. The leading members must line up with struct
+* avail so the tag and kval of any block can be read without knowing whether
+* it is free.
+*/
+struct buddy_header
+{
+    unsigned short int tag; /*BLOCK_RESERVED while the block is allocated*/
+    unsigned short int kval; /*The kval of this block*/
+    unsigned int unused; /*Pads the header to 8 bytes, overlaps clean of struct avail*/
+};
+
+
+/**
+* A stack of cached blocks for one size class, linked through the next field
+* of their (still reserved) headers.
+*/
+struct buddy_magazine
+{
+    struct avail *top; /*Most recently cached block*/
+    size_t count; /*Number of blocks on the stack*/
+};
+
+
+/**
+* One set of allocation counters. A concurrent pool gives each thread a set
+* of its own on a separate cache line, so counting needs no atomic
+* read-modify-write; the sets are only added up by buddy_stats.
+*/
+struct buddy_stats_slot
+{
+    uintptr_t owner; /*Token of the thread that writes this slot, 0 while unclaimed*/
+    uint64_t allocs; /*Successful allocations*/
+    uint64_t frees; /*Blocks freed*/
+    uint64_t failed; /*Allocations that found no memory*/
+    uint64_t requested; /*Bytes asked for by successful allocations*/
+    uint64_t granted; /*Bytes of the blocks handed out*/
+    uint64_t freed; /*Bytes of the blocks given back*/
+    uint64_t high; /*Bytes in use through this slot that trigger the next peak update*/
+};
+
+
 /**
 * The buddy memory pool.
 */
@@ -54,18 +161,102 @@ struct buddy_pool
 {
     size_t kval_m; /*The max kval of this pool*/
     size_t numbytes; /*The number of bytes this pool is managing*/
+    size_t kval_max; /*kval of the reserved address space the pool can grow to*/
     void *base; /*Base address used to scale memory for buddy
     calculations*/
+    uint64_t avail_mask; /*Bit k is set when avail[k] is not empty*/
+    unsigned int flags; /*BUDDY_* flags the pool was created with*/
     struct avail avail[MAX_K]; /*The array of available memory blocks*/
+    pthread_mutex_t locks[MAX_K]; /*Lock for each avail[k] in a concurrent pool*/
+    uint64_t *free_map[MAX_K]; /*BUDDY_NOHEADER: bit i set when block i of class k is free*/
+    uint64_t *alloc_map[MAX_K]; /*BUDDY_NOHEADER: bit i set when block i of class k is allocated*/
+    void *meta; /*Mapping that holds the bitmaps*/
+    size_t meta_bytes; /*Size of the meta mapping*/
+    size_t decommit_k; /*Free blocks of at least this kval are returned to the OS, 0 disables*/
+    int decommit_advice; /*madvise advice used to return them*/
+    size_t page_size; /*System page size*/
+    size_t nfree[MAX_K]; /*Number of blocks on avail[k]*/
+    size_t lazy_max[MAX_K]; /*BUDDY_LAZY: free blocks avail[k] keeps before coalescing*/
+    uint64_t nsplit[MAX_K]; /*Splits of a larger block into two class k halves*/
+    uint64_t nmerge[MAX_K]; /*Pairs of class k buddies merged into one block*/
+    uint64_t *lf_summary[MAX_K]; /*BUDDY_LOCKFREE: bit w set when word w of free_map[k] may have a free block*/
+    pthread_t owner; /*BUDDY_REMOTE_FREE: thread whose frees go straight to the free lists*/
+    struct avail *remote; /*BUDDY_REMOTE_FREE: blocks freed by other threads, linked through next*/
+    size_t lf_hint[MAX_K]; /*BUDDY_LOCKFREE: free_map[k] word a block of class k was last published in or taken from*/
+    uint64_t stats_id; /*Never reused, tells threads apart the pools they cached a stats slot for*/
+    struct buddy_stats_slot stats_shared; /*Counters of a pool used by one thread, or shared by threads without a slot*/
+    struct buddy_stats_slot *stats; /*BUDDY_CONCURRENT: BUDDY_STATS_SLOTS per thread counters*/
+    uint64_t stats_peak; /*Most bytes seen in use at once*/
     };
 
 
+/**
+* Snapshot of a pool's counters filled in by buddy_stats. Block sizes count
+* the header and the rounding up to a power of two.
+*/
+struct buddy_stats
+{
+    size_t pool_bytes; /*Bytes the pool manages right now*/
+    size_t bytes_in_use; /*Bytes of the blocks handed out and not yet freed*/
+    size_t peak_bytes_in_use; /*Most bytes in use at once*/
+    size_t bytes_free; /*Bytes of the blocks on the free lists*/
+    uint64_t allocs; /*Successful allocations, every block of a batch counts*/
+    uint64_t frees; /*Blocks freed*/
+    uint64_t failed; /*Allocations that returned NULL with errno set to ENOMEM*/
+    uint64_t bytes_requested; /*Bytes asked for by successful allocations*/
+    uint64_t bytes_granted; /*Bytes of the blocks they were given*/
+    size_t free_blocks[MAX_K]; /*Free blocks of each kval*/
+    uint64_t splits[MAX_K]; /*Splits of a larger block into two halves of each kval*/
+    uint64_t merges[MAX_K]; /*Pairs of buddies of each kval merged*/
+};
+
+
 /**
 * Converts bytes to its equivalent K value defined as bytes <= 2^K
+*
+* This is constant time: the answer is the bit width of bytes-1, computed
+* with count-leading-zeros when the compiler provides it and with a bit smear
+* plus population count otherwise. A value of 0 or 1 maps to K = 0.
+*
 * @param bytes The bytes needed
 * @return K The number of bytes expressed as 2^K
 */
-size_t btok(size_t bytes);
+static inline size_t btok(size_t bytes)
+{
+    if (bytes <= 1)
+    {
+        return 0;
+    }
+    uint64_t v = (uint64_t)bytes - 1;
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)(64 - __builtin_clzll(v));
+#else
+    //Smear the highest set bit into every lower bit and count them
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    v |= v >> 32;
+    v = v - ((v >> 1) & UINT64_C(0x5555555555555555));
+    v = (v & UINT64_C(0x3333333333333333)) + ((v >> 2) & UINT64_C(0x3333333333333333));
+    v = (v + (v >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+    return (size_t)((v * UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+
+/**
+* Bytes buddy_malloc keeps in front of the user pointer. BUDDY_NOHEADER pools
+* hand out the block itself.
+*
+* @param pool The memory pool
+* @return The offset of the user pointer from the start of its block
+*/
+static inline size_t buddy_hdr_size(struct buddy_pool *pool)
+{
+    return (pool->flags & BUDDY_NOHEADER) ? 0 : sizeof(struct buddy_header);
+}
 
 
 /**
@@ -111,6 +302,102 @@ void *buddy_malloc(struct buddy_pool *pool, size_t size);
 void buddy_free(struct buddy_pool *pool, void *ptr);
 
 
+/**
+* Allocates memory for an array of nmemb elements of size bytes each and
+* sets it to zero.
+*
+* Every free block remembers from which offset on it is known to be zero:
+* memory that was never handed out since the pool was mapped, and pages
+* decommitted with MADV_DONTNEED, are zero already and are not cleared
+* again. Only the bytes that may have been written are cleared, and a range
+* of at least BUDDY_CALLOC_RELEASE bytes is cleared by dropping its pages,
+* which then fault back in zero filled on first touch.
+*
+* @param pool The memory pool to alloc from
+* @param nmemb Number of elements
+* @param size Size of each element in bytes
+* @return A pointer to the zeroed memory or NULL with errno set to ENOMEM
+* when nmemb * size overflows or no block is available
+*/
+void *buddy_calloc(struct buddy_pool *pool, size_t nmemb, size_t size);
+
+
+/**
+* Same as buddy_malloc but also reports how many bytes the caller may
+* actually use. Blocks are a power of two, so a request is usually rounded
+* up and the slack can be used without calling buddy_realloc.
+*
+* @param pool The memory pool to alloc from
+* @param size The minimum number of bytes wanted
+* @param actual Set to the usable size of the block when not NULL
+* @return A pointer to the memory block or NULL with errno set
+*/
+void *buddy_malloc_at_least(struct buddy_pool *pool, size_t size, size_t *actual);
+
+
+/**
+* Returns the number of bytes that can be used through ptr, which is at
+* least the size it was allocated with.
+*
+* @param pool The memory pool
+* @param ptr Pointer returned by one of the buddy_*alloc functions
+* @return The usable size, or 0 if ptr is NULL or not an allocated block
+*/
+size_t buddy_usable_size(struct buddy_pool *pool, void *ptr);
+
+
+/**
+* Same as buddy_free but takes the block size from the caller instead of
+* looking it up and validating the pointer. size is any value between the
+* size ptr was requested with and its usable size; the block's kval follows
+* from it. Only for pointers from buddy_malloc, buddy_malloc_at_least,
+* buddy_realloc and buddy_malloc_batch, not buddy_aligned_alloc. Passing the
+* wrong size is undefined behavior, except for a size larger than the pool
+* can hand out, which is reported and the block is left alone. An assert
+* still reads the header or alloc bitmap to check the size unless NDEBUG is
+* defined, as in make release, so only those builds save the lookup.
+*
+* @param pool The memory pool
+* @param ptr Pointer to the memory block to free
+* @param size Size the block was allocated with
+*/
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size);
+
+
+/**
+* Allocates n blocks of size bytes at once. Instead of searching and
+* splitting once per block, a single block big enough for a power of two
+* number of them is taken and cut into siblings, so a batch of n costs about
+* log2(n) trips to the free lists. The blocks are stored in out in address
+* order within each group of siblings.
+*
+* @param pool The memory pool to alloc from
+* @param size The size of each user requested memory block in bytes
+* @param n The number of blocks wanted
+* @param out Array of at least n pointers that receives the blocks
+* @return The number of blocks stored in out. When it is less than n errno
+* is set to ENOMEM (or EINVAL for a bad pool or size of 0)
+*/
+size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out);
+
+
+/**
+* Frees n blocks at once. The pointers are sorted by address and blocks
+* that are buddies of each other are merged before anything is handed back
+* to the free lists, so a batch of siblings costs one coalesce rather than
+* one per block. Invalid pointers are reported and skipped like buddy_free
+* does, NULL entries are ignored.
+*
+* The ptrs array is used as scratch space and its contents are undefined
+* once the call returns.
+*
+* @param pool The memory pool
+* @param ptrs Pointers to the memory blocks to free
+* @param n Number of pointers in ptrs
+*/
+void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t n);
+
+
 /**
 * Changes the size of the memory block pointed to by ptr.
 * The function may move the memory block to a new location
@@ -157,6 +444,334 @@ void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size);
 void buddy_init(struct buddy_pool *pool, size_t size);
 
 
+/**
+* Same as buddy_init but accepts BUDDY_* flags that change how the pool
+* behaves. buddy_init is equivalent to passing 0.
+*
+* BUDDY_NOHEADER pools keep no header in allocated blocks. Which blocks are
+* free or allocated, and at which kval, is recorded in a free and an alloc
+* bitmap per class indexed by the block's offset from base, so buddy_free
+* finds the size and coalesces by looking only at the bitmaps; a buddy's
+* memory is only written once it is known to be free. Blocks are exactly a
+* power of two and aligned to their size relative to base. The bitmaps take
+* two bits per SMALLEST_K block of the pool.
+*
+* BUDDY_LOCKFREE pools drop the free lists and use the free bitmaps of a
+* BUDDY_NOHEADER pool on their own. A block is claimed by atomically
+* clearing its free bit and published by setting it, so buddy_malloc and
+* buddy_free never take a lock; only growing a reserved pool does. Two
+* buddies freed at the same time are still merged, but an allocation racing
+* with a free can leave a free pair unmerged until the next buddy_compact,
+* which allocations that find no large enough block run on their own. Finding
+* a free block scans the bitmap of its class, starting from where the last
+* one was found, guided by a summary bitmap with a bit per bitmap word.
+*
+* BUDDY_HUGETLB and BUDDY_HUGETLB_1G map the pool from the hugetlb pool
+* (MAP_HUGETLB), which needs pages reserved through
+* /proc/sys/vm/nr_hugepages and a pool at least one huge page in size.
+* BUDDY_THP aligns the pool to 2 MiB and advises MADV_HUGEPAGE so the kernel
+* backs it with transparent huge pages. When explicit huge pages can not be
+* had the pool falls back to BUDDY_THP, and when that is not supported to
+* normal pages; the flags left in pool->flags say which backing was used.
+* Decommit never splits a huge page of a hugetlb backed pool.
+*
+* @param pool A pointer to the pool to initialize
+* @param size The size of the pool in bytes.
+* @param flags Bitwise or of BUDDY_* flags
+*/
+void buddy_init_flags(struct buddy_pool *pool, size_t size, unsigned int flags);
+
+
+/**
+* Same as buddy_init_flags but reserves address space for a pool of up to
+* max_size bytes and only commits size bytes of it. When the pool runs out
+* of memory it doubles in place: the next 2^kval_m bytes of the reservation
+* are made accessible and become the upper buddy of the old top block, so
+* the pool keeps a single base and blocks never move. A max_size of 0 asks
+* for 2^(MAX_K-1); if the address space is not available the reservation
+* is halved until it is, and pool->kval_max records the size reached.
+*
+* The reservation is mapped PROT_NONE with MAP_NORESERVE and costs no memory
+* until the pool grows into it. Hugetlb pages can not be reserved this way,
+* BUDDY_HUGETLB and BUDDY_HUGETLB_1G fall back to BUDDY_THP.
+*
+* @param pool A pointer to the pool to initialize
+* @param size The initial size of the pool in bytes.
+* @param max_size The largest size the pool may grow to in bytes.
+* @param flags Bitwise or of BUDDY_* flags
+*/
+void buddy_init_reserve(struct buddy_pool *pool, size_t size, size_t max_size, unsigned int flags);
+
+
+/**
+* Allocates size bytes whose address is a multiple of align, which must be a
+* power of two. The buddy system already aligns every block to its own size
+* (the pool base is mapped aligned to the pool size), so a header free pool
+* only rounds the class up to align. A pool with headers needs the user data
+* to start on an align boundary after the header, so it asks for size + align
+* bytes. The result is released with buddy_free.
+*
+* @param pool The memory pool to alloc from
+* @param align The required alignment in bytes, a power of two
+* @param size The size of the user requested memory block in bytes
+* @return A pointer to the memory block, or NULL with errno set to EINVAL for
+* a bad alignment or ENOMEM when no block is available
+*/
+void *buddy_aligned_alloc(struct buddy_pool *pool, size_t align, size_t size);
+
+
+/**
+* Returns the kval of the block backing a pointer returned by buddy_malloc.
+*
+* @param pool The memory pool
+* @param ptr Pointer to an allocated memory block
+* @return The kval of the block, or 0 if ptr is not an allocated block
+*/
+size_t buddy_block_kval(struct buddy_pool *pool, void *ptr);
+
+
+/**
+* Return the memory of large free blocks to the operating system. Whenever
+* buddy_free leaves a free block of at least threshold bytes, every page of
+* it except the first (which holds the free list links) is released with
+* madvise. The pages are faulted back in, zero filled or with their old
+* contents depending on the advice, the next time the block is used.
+*
+* advice is MADV_DONTNEED, which drops the pages immediately, or MADV_FREE,
+* which lets the kernel reclaim them lazily under memory pressure and is
+* cheaper when blocks are reused quickly. A threshold of 0 turns decommit
+* off, which is the default. Blocks are never smaller than two pages when
+* decommitted. Call this before the pool is shared between threads.
+*
+* @param pool The memory pool
+* @param threshold Smallest free block size in bytes to decommit, 0 for off
+* @param advice MADV_DONTNEED or MADV_FREE
+* @return 0 on success or -1 with errno set to EINVAL for an unknown advice
+*/
+int buddy_set_decommit(struct buddy_pool *pool, size_t threshold, int advice);
+
+
+/**
+* Defer coalescing for blocks of kval. A freed block is left in its class
+* without looking at its buddy as long as the class holds fewer than
+* watermark free blocks, so a steady stream of frees and mallocs of one size
+* reuses the same blocks instead of merging them on every free and
+* splitting them again on the next malloc. Above the watermark blocks are
+* coalesced as usual, absorbing any deferred buddies on the way. Deferred
+* blocks are merged when an allocation finds no block large enough, or by
+* buddy_compact.
+*
+* A kval of 0 sets the watermark of every class. A watermark of 0 makes a
+* class coalesce eagerly again; the pool leaves lazy mode (BUDDY_LAZY in
+* pool->flags) when no class has a watermark. Creating a pool with
+* BUDDY_LAZY is the same as setting BUDDY_LAZY_DEFAULT for every class.
+* Call this before the pool is shared between threads.
+*
+* @param pool The memory pool
+* @param kval The class to set, or 0 for all of them
+* @param watermark Free blocks the class keeps before coalescing
+*/
+void buddy_set_lazy(struct buddy_pool *pool, size_t kval, size_t watermark);
+
+
+/**
+* Coalesce every deferred free block with its buddy, smallest class first so
+* merges cascade all the way up. With BUDDY_CONCURRENT this locks two
+* adjacent classes at a time and may run alongside other calls.
+*
+* @param pool The memory pool
+* @return The number of merges done
+*/
+size_t buddy_compact(struct buddy_pool *pool);
+
+
+/**
+* Make the calling thread the owner of a BUDDY_REMOTE_FREE pool. The thread
+* that initializes a pool owns it until this is called.
+*
+* In a BUDDY_REMOTE_FREE pool buddy_free, buddy_free_sized and
+* buddy_free_batch called from any other thread only push the block onto a
+* lock-free queue with a single compare-and-swap; they never take a class
+* lock or touch the free lists. The owner's next allocation takes the whole
+* queue at once and frees every block on it. Without BUDDY_CONCURRENT the
+* owner is the only thread that may allocate or resize, and other threads
+* may only free, which makes a pool per producer thread with consumers
+* freeing into it work without any locks at all.
+*
+* Call this while no other thread is freeing into the pool.
+*
+* @param pool The memory pool
+*/
+void buddy_set_owner(struct buddy_pool *pool);
+
+
+/**
+* Free every block that other threads queued for the owner of a
+* BUDDY_REMOTE_FREE pool. Allocations do this on their own, calling it
+* directly is for an owner that wants the memory back without allocating.
+* Must be called from the owner unless the pool is BUDDY_CONCURRENT.
+*
+* @param pool The memory pool
+* @return The number of blocks freed
+*/
+size_t buddy_drain_remote(struct buddy_pool *pool);
+
+
+/**
+* Where the free memory of a pool sits, filled in by buddy_fragmentation.
+*/
+struct buddy_frag
+{
+    size_t bytes_free; /*Bytes of all free blocks*/
+    size_t largest_free; /*Size of the largest free block, 0 if there is none*/
+    size_t bytes_free_by_class[MAX_K]; /*Bytes of the free blocks of each kval*/
+    double index; /*1 - largest_free / bytes_free: 0 when the free memory is one
+    block, close to 1 when it is spread over many small ones*/
+    double unusable[MAX_K]; /*Share of bytes_free in blocks too small to serve a
+    block of kval, 0 when nothing is free*/
+};
+
+
+/**
+* Called by buddy_walk for each block. block is the start of the block, the
+* user pointer of an allocated block follows its header. Returning non-zero
+* stops the walk.
+*/
+typedef int (*buddy_walk_fn)(void *ctx, void *block, size_t kval, bool is_free);
+
+
+/**
+* Position of a walk that is done in steps, see buddy_walk_step. Start with
+* a zeroed cursor.
+*/
+struct buddy_walk_cursor
+{
+    size_t offset; /*Offset from base of the next block to visit*/
+    int stopped; /*Non-zero value the callback stopped the walk with*/
+};
+
+
+/**
+* Fill out with the pool's counters. They are kept on every allocation and
+* free at the cost of a few additions: a pool used by one thread has a single
+* set of counters, and a BUDDY_CONCURRENT pool gives each of the first
+* BUDDY_STATS_SLOTS threads that use it a set of its own so threads never
+* write the same cache line. The sets are only added up here.
+*
+* The peak is exact in a pool used by one thread. A concurrent pool only
+* recomputes it when a thread's own usage grows by a sixteenth, so it is a
+* lower bound that can miss a short lived peak. Frees queued by
+* BUDDY_REMOTE_FREE count once the owner drains them, and blocks held by a
+* struct buddy_cache or struct buddy_slab_cache count as in use.
+*
+* Without BUDDY_CONCURRENT call this from the thread that uses the pool.
+*
+* @param pool The memory pool
+* @param out Receives the counters
+*/
+void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out);
+
+
+/**
+* Returns the largest size buddy_malloc can serve from the pool as it is
+* now, without growing a reserved pool. This only looks at the occupancy
+* mask, so it costs the same however full or fragmented the pool is and can
+* turn a request away before it searches the free lists. In a BUDDY_LAZY or
+* BUDDY_LOCKFREE pool free buddies that have not been merged yet are not
+* counted, buddy_compact may make room for more.
+*
+* @param pool The memory pool
+* @return The largest request that fits, 0 if the pool is full
+*/
+size_t buddy_largest_free(struct buddy_pool *pool);
+
+
+/**
+* Report how fragmented the free memory of a pool is. When buddy_malloc
+* fails with ENOMEM an index near 0 means the pool is full, one near 1 that
+* there is free memory but only in blocks too small for the request.
+* unusable[k] tells how much of the free memory a request of class k can not
+* use. The report walks the per class free counts only, and is a snapshot
+* that other threads may change while it is taken.
+*
+* @param pool The memory pool
+* @param out Receives the report
+*/
+void buddy_fragmentation(struct buddy_pool *pool, struct buddy_frag *out);
+
+
+/**
+* Visit every block of the pool in address order, free or allocated, from
+* base up to the current pool size. Each block's size comes from its header,
+* or from the side bitmaps in a BUDDY_NOHEADER pool, so the walk costs one
+* look per block. It is done in steps of BUDDY_WALK_STEP blocks like
+* buddy_walk_step does.
+*
+* fn must not allocate from or free into the pool.
+*
+* @param pool The memory pool
+* @param fn Called for each block
+* @param ctx Passed to fn
+* @return 0 if every block was visited, otherwise the value fn stopped with
+*/
+int buddy_walk(struct buddy_pool *pool, buddy_walk_fn fn, void *ctx);
+
+
+/**
+* Visit up to max_blocks blocks from where cursor left off, so a long walk
+* can be spread out. The result is only exact while no other thread uses the
+* pool. In a BUDDY_CONCURRENT pool every class lock is held for the length of
+* one step, which keeps free lists still but stops other threads, so keep
+* steps short. Splits and merges finish outside the class locks, so a step
+* can still find a block in the middle of one: it is reported with whatever
+* state its header or bitmap shows, or skipped when it has none. Blocks that
+* split or merge between two steps may be missed or seen twice; a block that
+* now starts before the cursor is skipped. A BUDDY_LOCKFREE pool is never
+* stopped.
+*
+* @param pool The memory pool
+* @param cursor Where to continue, zeroed for a new walk
+* @param max_blocks Most blocks to visit in this step
+* @param fn Called for each block, see buddy_walk
+* @param ctx Passed to fn
+* @return true while blocks are left and fn has not stopped the walk
+*/
+bool buddy_walk_step(struct buddy_pool *pool, struct buddy_walk_cursor *cursor,
+    size_t max_blocks, buddy_walk_fn fn, void *ctx);
+
+
+/**
+* Take every class lock of a BUDDY_CONCURRENT pool, which stops all other
+* threads at their next trip to the free lists (a BUDDY_LOCKFREE pool only
+* when it grows). Meant for fork handlers: lock before fork and unlock in
+* both the parent and the child, so the child does not inherit a lock held
+* by a thread that no longer exists. Does nothing for other pools.
+*
+* @param pool The memory pool
+*/
+void buddy_pool_lock(struct buddy_pool *pool);
+
+
+/**
+* Release the locks taken by buddy_pool_lock.
+*
+* @param pool The memory pool
+*/
+void buddy_pool_unlock(struct buddy_pool *pool);
+
+
+/**
+* Initialize a pool that can be shared between threads. Every avail[k] list
+* has its own lock, so buddy_malloc only contends on the classes it splits
+* and buddy_free only on the classes it coalesces through. Same as calling
+* buddy_init_flags with BUDDY_CONCURRENT.
+*
+* @param pool A pointer to the pool to initialize
+* @param size The size of the pool in bytes.
+*/
+void buddy_init_concurrent(struct buddy_pool *pool, size_t size);
+
+
 /**
 * Inverse of buddy_init.
 *
@@ -169,6 +784,317 @@ void buddy_destroy(struct buddy_pool *pool);
 
 
 
+/**
+* A cache of free blocks that sits in front of a pool and is owned by a
+* single thread. Each size class up to BUDDY_CACHE_MAX_K has a magazine that
+* is refilled from, and drained back to, the pool in batches of half its
+* depth, so a malloc/free pair on the owning thread never touches the pool.
+*/
+struct buddy_cache
+{
+    struct buddy_pool *pool; /*The pool blocks are borrowed from*/
+    size_t depth; /*Maximum number of blocks held per class*/
+    struct buddy_magazine mags[BUDDY_CACHE_MAX_K + 1]; /*One magazine per kval*/
+};
+
+
+/**
+* Initialize a cache in front of pool. A cache must only be used by one
+* thread at a time; to share a pool between threads create it with
+* BUDDY_CONCURRENT and give every thread its own cache.
+*
+* @param cache The cache to initialize
+* @param pool The pool to borrow blocks from
+* @param depth Maximum blocks per class, 0 for BUDDY_CACHE_DEFAULT_DEPTH
+*/
+void buddy_cache_init(struct buddy_cache *cache, struct buddy_pool *pool, size_t depth);
+
+
+/**
+* Same as buddy_malloc but served from the cache's magazines when possible.
+*
+* @param cache The cache to allocate from
+* @param size The size of the user requested memory block in bytes
+* @return A pointer to the memory block or NULL with errno set
+*/
+void *buddy_cache_malloc(struct buddy_cache *cache, size_t size);
+
+
+/**
+* Same as buddy_free but keeps the block in the cache's magazine for its
+* class. ptr may come from any cache or directly from buddy_malloc as long as
+* it belongs to the cache's pool.
+*
+* @param cache The cache to free into
+* @param ptr Pointer to the memory block to free
+*/
+void buddy_cache_free(struct buddy_cache *cache, void *ptr);
+
+
+/**
+* Return every cached block to the pool. Must be called before the cache is
+* thrown away, otherwise the blocks it holds are lost to the pool.
+*
+* @param cache The cache to flush
+*/
+void buddy_cache_flush(struct buddy_cache *cache);
+
+
+
+/**
+* Bookkeeping kept at the start of every slab. The free bitmap follows it
+* and the objects follow the bitmap.
+*/
+struct buddy_slab
+{
+    struct buddy_slab *next; /*Next slab of the class with free objects*/
+    struct buddy_slab *prev; /*Previous slab of the class with free objects*/
+    unsigned int size; /*Object size*/
+    unsigned int nslots; /*Number of objects in the slab*/
+    unsigned int nfree; /*Number of free objects*/
+    unsigned int hint; /*Lowest bitmap word that may have a free object*/
+    unsigned char *objects; /*First object*/
+    uint64_t free_map[]; /*Bit i set when object i is free*/
+};
+
+
+/**
+* A slab allocator for objects of up to BUDDY_SLAB_MAX_SIZE bytes. Each slab
+* is a 2^BUDDY_SLAB_K block from the pool cut into equal objects, so small
+* objects pay neither the header nor the power of two rounding of the pool.
+* Which blocks of the pool are slabs is kept in a bitmap indexed by offset
+* from base, and an object finds its slab by rounding its address down to
+* the slab size. Like struct buddy_cache a slab cache must only be used by
+* one thread at a time.
+*/
+struct buddy_slab_cache
+{
+    struct buddy_pool *pool; /*The pool slabs are taken from*/
+    struct buddy_slab *partial[BUDDY_SLAB_CLASSES]; /*Slabs with free objects per class*/
+    uint64_t *owner; /*Bit i set when block i of size 2^BUDDY_SLAB_K is a slab*/
+    size_t owner_bytes; /*Size of the owner mapping*/
+};
+
+
+/**
+* Initialize a slab cache in front of pool.
+*
+* @param cache The slab cache to initialize
+* @param pool The pool to take slabs from
+*/
+void buddy_slab_init(struct buddy_slab_cache *cache, struct buddy_pool *pool);
+
+
+/**
+* Allocate size bytes from the slab class for size, or from the pool when
+* size is larger than BUDDY_SLAB_MAX_SIZE.
+*
+* @param cache The slab cache to allocate from
+* @param size The size of the user requested memory block in bytes
+* @return A pointer aligned to BUDDY_SLAB_ALIGN or NULL with errno set
+*/
+void *buddy_slab_malloc(struct buddy_slab_cache *cache, size_t size);
+
+
+/**
+* Free memory returned by buddy_slab_malloc. A slab that becomes empty is
+* given back to the pool unless it is the last slab of its class with free
+* objects.
+*
+* @param cache The slab cache ptr was allocated from
+* @param ptr Pointer to the memory to free
+*/
+void buddy_slab_free(struct buddy_slab_cache *cache, void *ptr);
+
+
+/**
+* Return every slab to the pool, including ones with live objects.
+*
+* @param cache The slab cache to destroy
+*/
+void buddy_slab_destroy(struct buddy_slab_cache *cache);
+
+
+
+/**
+* A pool that grows. An arena starts with a single region, an ordinary buddy
+* pool of region size, and maps another region whenever no existing one can
+* satisfy a request instead of failing with ENOMEM. Requests bigger than a
+* region get a region of their own. A region other than the first that
+* becomes completely free is unmapped again; BUDDY_LAZY and BUDDY_LOCKFREE
+* regions are compacted first once all of their memory is free. Every
+* region is aligned to its size, so a pointer is mapped back to its region
+* by address.
+*/
+struct buddy_arena
+{
+    size_t region_k; /*kval of a normal region*/
+    unsigned int flags; /*BUDDY_* flags every region is created with*/
+    size_t nregions; /*Number of regions in use*/
+    struct buddy_pool *regions[BUDDY_ARENA_MAX_REGIONS]; /*Regions, the first is never released*/
+    pthread_rwlock_t lock; /*BUDDY_CONCURRENT: held for writing while regions change*/
+};
+
+
+/**
+* Initialize an arena whose regions are region_size bytes, rounded up like
+* buddy_init does. The flags are passed to buddy_init_flags for every region.
+* With BUDDY_CONCURRENT the arena may be shared between threads.
+*
+* @param arena The arena to initialize
+* @param region_size Size of a region in bytes, 0 for 2^DEFAULT_K
+* @param flags Bitwise or of BUDDY_* flags
+*/
+void buddy_arena_init(struct buddy_arena *arena, size_t region_size, unsigned int flags);
+
+
+/**
+* Same as buddy_malloc, adding a region when the existing ones are full.
+*
+* @param arena The arena to allocate from
+* @param size The size of the user requested memory block in bytes
+* @return A pointer to the memory block or NULL with errno set to ENOMEM
+* when no more regions can be mapped
+*/
+void *buddy_arena_malloc(struct buddy_arena *arena, size_t size);
+
+
+/**
+* Same as buddy_free, unmapping the region ptr came from if that leaves it
+* empty.
+*
+* @param arena The arena ptr was allocated from
+* @param ptr Pointer to the memory block to free
+*/
+void buddy_arena_free(struct buddy_arena *arena, void *ptr);
+
+
+/**
+* Same as buddy_realloc. The block is resized in its own region when
+* possible and moved to another region otherwise.
+*
+* @param arena The arena ptr was allocated from
+* @param ptr Pointer to a memory block
+* @param size The new size of the memory block
+* @return Pointer to the new memory block
+*/
+void *buddy_arena_realloc(struct buddy_arena *arena, void *ptr, size_t size);
+
+
+/**
+* Unmap every region of the arena.
+*
+* @param arena The arena to destroy
+*/
+void buddy_arena_destroy(struct buddy_arena *arena);
+
+
+
+/**
+* A set of pools, one per NUMA node. Each pool's memory is bound to its node
+* with mbind before it is touched, and allocations go to the pool of the
+* node the calling thread runs on. A full pool falls back to the others,
+* nearest node first according to the kernel's node distances. The policy
+* is MPOL_PREFERRED, so a node that runs out of pages falls back to another
+* node instead of failing the page fault.
+*
+* Nothing beyond the raw mbind and getcpu system calls is used. Machines
+* with a single node, kernels without NUMA support and sandboxes that refuse
+* mbind all end up with working pools; bound says whether the binding took.
+*/
+struct buddy_numa
+{
+    size_t npools; /*Number of pools in the set*/
+    int node[BUDDY_NUMA_MAX_NODES]; /*OS node id each pool is bound to*/
+    struct buddy_pool *pools[BUDDY_NUMA_MAX_NODES]; /*Pool of each node, each descriptor in its own mapping*/
+    unsigned char order[BUDDY_NUMA_MAX_NODES][BUDDY_NUMA_MAX_NODES]; /*order[i] lists the pools to try for pool i's node, nearest first*/
+    bool bound; /*Every pool was bound to its node*/
+};
+
+
+/**
+* Initialize a set with a pool of node_size bytes for every node that has
+* memory, as listed in /sys/devices/system/node. The flags are passed to
+* buddy_init_flags for every pool; with BUDDY_CONCURRENT the set may be
+* shared between threads. A machine without that information gets a single
+* pool for node 0.
+*
+* @param set The set to initialize
+* @param node_size Size of each pool in bytes
+* @param flags Bitwise or of BUDDY_* flags
+* @return 0 on success or -1 with errno set
+*/
+int buddy_numa_init(struct buddy_numa *set, size_t node_size, unsigned int flags);
+
+
+/**
+* Same as buddy_numa_init for an explicit list of OS node ids. A node may be
+* listed more than once, which gives it several pools that are tried in
+* order.
+*
+* @param set The set to initialize
+* @param node_size Size of each pool in bytes
+* @param flags Bitwise or of BUDDY_* flags
+* @param nodes OS node ids, one per pool
+* @param nnodes Number of entries in nodes, 1 to BUDDY_NUMA_MAX_NODES
+* @return 0 on success or -1 with errno set to EINVAL for a bad node list
+*/
+int buddy_numa_init_nodes(struct buddy_numa *set, size_t node_size, unsigned int flags,
+    const int *nodes, size_t nnodes);
+
+
+/**
+* Allocate size bytes from the pool of the node the calling thread runs on,
+* falling back to the other pools nearest first. The node is looked up with
+* getcpu and cached per thread for a while, a thread that migrates keeps
+* using its old node for at most that many calls.
+*
+* @param set The set to allocate from
+* @param size The size of the user requested memory block in bytes
+* @return A pointer to the memory block or NULL with errno set to ENOMEM
+* when every pool is full
+*/
+void *buddy_numa_malloc(struct buddy_numa *set, size_t size);
+
+
+/**
+* Same as buddy_numa_malloc for a caller on OS node node. A node without a
+* pool of its own starts with the first pool.
+*
+* @param set The set to allocate from
+* @param size The size of the user requested memory block in bytes
+* @param node OS node id to allocate for
+* @return A pointer to the memory block or NULL
+*/
+void *buddy_numa_malloc_node(struct buddy_numa *set, size_t size, int node);
+
+
+/**
+* Return memory allocated from the set to the pool it came from.
+*
+* @param set The set ptr was allocated from
+* @param ptr Pointer to the memory block to free
+*/
+void buddy_numa_free(struct buddy_numa *set, void *ptr);
+
+
+/**
+* @param set The set ptr was allocated from
+* @param ptr Pointer into a block of the set
+* @return The OS node id of the pool holding ptr or -1 if no pool does
+*/
+int buddy_numa_node_of(struct buddy_numa *set, void *ptr);
+
+
+/**
+* Unmap every pool of the set.
+*
+* @param set The set to destroy
+*/
+void buddy_numa_destroy(struct buddy_numa *set);
+
+
+
 /**
 * @brief Entry to a main function for testing purposes
 *
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "lab.h"
+
+/**
+* Number of blocks moved between a magazine and the pool per batch call
+*/
+#define MAG_CHUNK 64
+
+/**
+* @brief Start of the block handed out by buddy_malloc. A cached block is not
+* in use, so its next field (which overlaps the start of the user data) is
+* free to link the magazine together.
+*/
+static inline struct avail *mag_header(struct buddy_pool *pool, void *ptr)
+{
+    return (struct avail *)((unsigned char *)ptr - buddy_hdr_size(pool));
+}
+
+/**
+* @brief Inverse of mag_header
+*/
+static inline void *mag_user(struct buddy_pool *pool, struct avail *block)
+{
+    return (unsigned char *)block + buddy_hdr_size(pool);
+}
+
+/**
+* @brief Number of user bytes that make buddy_malloc pick exactly kval
+*/
+static inline size_t mag_class_bytes(struct buddy_pool *pool, size_t kval)
+{
+    return (UINT64_C(1) << kval) - buddy_hdr_size(pool);
+}
+
+/**
+* @brief Move half a magazine worth of blocks from the pool into mag, a chunk
+* of MAG_CHUNK siblings at a time through buddy_malloc_batch. The lowest
+* address ends up on top so blocks are handed out in address order.
+*/
+static void mag_refill(struct buddy_cache *cache, struct buddy_magazine *mag, size_t kval)
+{
+    size_t batch = cache->depth / 2 ? cache->depth / 2 : 1;
+    void *ptrs[MAG_CHUNK];
+    while (batch > 0)
+    {
+        size_t want = batch < MAG_CHUNK ? batch : MAG_CHUNK;
+        size_t got = buddy_malloc_batch(cache->pool, mag_class_bytes(cache->pool, kval), want, ptrs);
+        for (size_t i = got; i-- > 0;)
+        {
+            struct avail *block = mag_header(cache->pool, ptrs[i]);
+            block->next = mag->top;
+            mag->top = block;
+            mag->count++;
+        }
+        if (got < want)
+        {
+            break;
+        }
+        batch -= got;
+    }
+}
+
+/**
+* @brief Give the oldest half of a full magazine back to the pool.
+*/
+static void mag_drain(struct buddy_cache *cache, struct buddy_magazine *mag, size_t keep)
+{
+    //Keep the most recently freed blocks, they are the ones still in cache
+    struct avail *block = mag->top;
+    for (size_t i = 1; i < keep && block != NULL; i++)
+    {
+        block = block->next;
+    }
+    struct avail *rest = block;
+    if (keep == 0)
+    {
+        rest = mag->top;
+        mag->top = NULL;
+    }
+    else if (block != NULL)
+    {
+        rest = block->next;
+        block->next = NULL;
+    }
+    //Blocks that went out together tend to come back together, so freeing
+    //them as a batch lets siblings merge before they reach the pool
+    void *ptrs[MAG_CHUNK];
+    size_t n = 0;
+    while (rest != NULL)
+    {
+        ptrs[n++] = mag_user(cache->pool, rest);
+        mag->count--;
+        rest = rest->next;
+        if (n == MAG_CHUNK || rest == NULL)
+        {
+            buddy_free_batch(cache->pool, ptrs, n);
+            n = 0;
+        }
+    }
+}
+
+void buddy_cache_init(struct buddy_cache *cache, struct buddy_pool *pool, size_t depth)
+{
+    memset(cache, 0, sizeof(struct buddy_cache));
+    cache->pool = pool;
+    cache->depth = depth ? depth : BUDDY_CACHE_DEFAULT_DEPTH;
+}
+
+void *buddy_cache_malloc(struct buddy_cache *cache, size_t size)
+{
+    if (cache == NULL) {
+        fprintf(stderr, "Error: Null pointer passed as cache to buddy_cache_malloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (size == 0 || size > mag_class_bytes(cache->pool, BUDDY_CACHE_MAX_K)) {
+        return buddy_malloc(cache->pool, size);
+    }
+
+    size_t kval = btok(size + buddy_hdr_size(cache->pool));
+    if (kval < SMALLEST_K)
+    {
+        kval = SMALLEST_K;
+    }
+
+    struct buddy_magazine *mag = &cache->mags[kval];
+    if (mag->top == NULL)
+    {
+        mag_refill(cache, mag, kval);
+        if (mag->top == NULL)
+        {
+            //The pool is out of blocks of this class, let it set errno
+            return buddy_malloc(cache->pool, size);
+        }
+    }
+    struct avail *block = mag->top;
+    mag->top = block->next;
+    mag->count--;
+    return mag_user(cache->pool, block);
+}
+
+void buddy_cache_free(struct buddy_cache *cache, void *ptr)
+{
+    if (cache == NULL || ptr == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_cache_free.\n");
+        return;
+    }
+
+    struct buddy_pool *pool = cache->pool;
+    //Anything that is not one of our cacheable blocks is left to buddy_free,
+    //which reports invalid pointers
+    size_t kval = buddy_block_kval(pool, ptr);
+    bool aligned = !(pool->flags & BUDDY_NOHEADER) &&
+        ((struct buddy_header *)ptr - 1)->tag == BLOCK_ALIGNED;
+    if (kval == 0 || kval > BUDDY_CACHE_MAX_K || aligned)
+    {
+        buddy_free(pool, ptr);
+        return;
+    }
+
+    struct avail *block = mag_header(pool, ptr);
+    struct buddy_magazine *mag = &cache->mags[kval];
+    if (mag->count >= cache->depth)
+    {
+        mag_drain(cache, mag, cache->depth / 2);
+    }
+    block->next = mag->top;
+    mag->top = block;
+    mag->count++;
+}
+
+void buddy_cache_flush(struct buddy_cache *cache)
+{
+    for (size_t k = 0; k <= BUDDY_CACHE_MAX_K; k++)
+    {
+        mag_drain(cache, &cache->mags[k], 0);
+    }
+}
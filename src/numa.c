@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "lab.h"
+
+/**
+* Values from <linux/mempolicy.h>, spelled out so no NUMA headers or
+* libraries are needed.
+*/
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+/**
+* Highest OS node id + 1 that a node mask passed to mbind can hold.
+*/
+#define NUMA_MASK_NODES 1024
+/**
+* Calls of buddy_numa_malloc after which a thread looks up its node again.
+*/
+#define NUMA_REFRESH 1024
+/**
+* Node distance assumed when the kernel does not say.
+*/
+#define NUMA_LOCAL 10
+#define NUMA_REMOTE 20
+
+static __thread int cached_node = -1;
+static __thread unsigned int cached_calls;
+
+/**
+* @brief Node the calling thread runs on, 0 when it can not be found out
+*/
+static int current_node(void)
+{
+    if (cached_node >= 0 && ++cached_calls % NUMA_REFRESH != 0)
+    {
+        return cached_node;
+    }
+    cached_node = 0;
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu;
+    unsigned int node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+    {
+        cached_node = (int)node;
+    }
+#endif
+    return cached_node;
+}
+
+/**
+* @brief Ask the kernel to place the pages of addr from node, moving the
+* ones already touched.
+*
+* @return true when the policy was set
+*/
+static bool bind_node(void *addr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[NUMA_MASK_NODES / (8 * sizeof(unsigned long))] = {0};
+    size_t bits = 8 * sizeof(unsigned long);
+    if (node < 0 || node >= NUMA_MASK_NODES)
+    {
+        return false;
+    }
+    mask[(size_t)node / bits] = 1UL << ((size_t)node % bits);
+    return syscall(SYS_mbind, addr, len, NUMA_MPOL_PREFERRED, mask,
+        (unsigned long)NUMA_MASK_NODES + 1, NUMA_MPOL_MF_MOVE) == 0;
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+    return false;
+#endif
+}
+
+/**
+* @brief Parse a sysfs node list such as "0-1,3" into nodes
+*
+* @return Number of nodes stored, 0 if the file can not be read
+*/
+static size_t read_node_list(const char *path, int *nodes, size_t max)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    size_t n = 0;
+    int first;
+    while (n < max && fscanf(f, "%d", &first) == 1)
+    {
+        int last = first;
+        int c = fgetc(f);
+        if (c == '-')
+        {
+            if (fscanf(f, "%d", &last) != 1)
+            {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int node = first; node <= last && n < max; node++)
+        {
+            nodes[n++] = node;
+        }
+        if (c != ',')
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+/**
+* @brief Distance from node from to node to as the kernel reports it. The
+* distance file of a node lists one entry per online node in id order.
+*/
+static int node_distance(int from, int to)
+{
+    if (from == to)
+    {
+        return NUMA_LOCAL;
+    }
+    int online[NUMA_MASK_NODES];
+    size_t n = read_node_list("/sys/devices/system/node/online", online, NUMA_MASK_NODES);
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", from);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return NUMA_REMOTE;
+    }
+    int distance = NUMA_REMOTE;
+    int value;
+    for (size_t i = 0; i < n && fscanf(f, "%d", &value) == 1; i++)
+    {
+        if (online[i] == to)
+        {
+            distance = value;
+            break;
+        }
+    }
+    fclose(f);
+    return distance;
+}
+
+/**
+* @brief Index of the first pool bound to OS node node, the first pool if
+* there is none.
+*/
+static size_t pool_of_node(struct buddy_numa *set, int node)
+{
+    for (size_t i = 0; i < set->npools; i++)
+    {
+        if (set->node[i] == node)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Index of the pool that holds ptr, npools if none does
+*/
+static size_t pool_holding(struct buddy_numa *set, void *ptr)
+{
+    size_t i = 0;
+    for (; i < set->npools; i++)
+    {
+        unsigned char *base = set->pools[i]->base;
+        if ((unsigned char *)ptr >= base && (unsigned char *)ptr < base + set->pools[i]->numbytes)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+
+int buddy_numa_init(struct buddy_numa *set, size_t node_size, unsigned int flags)
+{
+    int nodes[BUDDY_NUMA_MAX_NODES];
+    size_t n = read_node_list("/sys/devices/system/node/has_memory", nodes, BUDDY_NUMA_MAX_NODES);
+    if (n == 0)
+    {
+        n = read_node_list("/sys/devices/system/node/online", nodes, BUDDY_NUMA_MAX_NODES);
+    }
+    if (n == 0)
+    {
+        nodes[0] = 0;
+        n = 1;
+    }
+    return buddy_numa_init_nodes(set, node_size, flags, nodes, n);
+}
+
+
+int buddy_numa_init_nodes(struct buddy_numa *set, size_t node_size, unsigned int flags,
+    const int *nodes, size_t nnodes)
+{
+    if (set == NULL || nodes == NULL || nnodes == 0 || nnodes > BUDDY_NUMA_MAX_NODES)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < nnodes; i++)
+    {
+        if (nodes[i] < 0 || nodes[i] >= NUMA_MASK_NODES)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    memset(set, 0, sizeof(struct buddy_numa));
+    set->bound = true;
+    for (size_t i = 0; i < nnodes; i++)
+    {
+        struct buddy_pool *pool = mmap(NULL, sizeof(struct buddy_pool), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == pool)
+        {
+            perror("buddy_numa_init pool mmap failed");
+            abort();
+        }
+        //Only the first page of the pool has been written so far
+        buddy_init_flags(pool, node_size, flags);
+        if (!bind_node(pool->base, pool->numbytes, nodes[i]))
+        {
+            set->bound = false;
+        }
+        set->pools[i] = pool;
+        set->node[i] = nodes[i];
+        set->npools++;
+    }
+
+    //Each pool tries itself first, then the rest by distance
+    int distance[BUDDY_NUMA_MAX_NODES];
+    for (size_t i = 0; i < nnodes; i++)
+    {
+        for (size_t j = 0; j < nnodes; j++)
+        {
+            distance[j] = j == i ? -1 : node_distance(nodes[i], nodes[j]);
+        }
+        for (size_t j = 0; j < nnodes; j++)
+        {
+            size_t k = j;
+            while (k > 0 && distance[set->order[i][k - 1]] > distance[j])
+            {
+                set->order[i][k] = set->order[i][k - 1];
+                k--;
+            }
+            set->order[i][k] = (unsigned char)j;
+        }
+    }
+    return 0;
+}
+
+
+void *buddy_numa_malloc(struct buddy_numa *set, size_t size)
+{
+    return buddy_numa_malloc_node(set, size, current_node());
+}
+
+
+void *buddy_numa_malloc_node(struct buddy_numa *set, size_t size, int node)
+{
+    if (set == NULL || size == 0) {
+        fprintf(stderr, "Error: Invalid arguments passed to buddy_numa_malloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t home = pool_of_node(set, node);
+    for (size_t i = 0; i < set->npools; i++) {
+        void *ptr = buddy_malloc(set->pools[set->order[home][i]], size);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    errno = ENOMEM;
+    return NULL;
+}
+
+
+void buddy_numa_free(struct buddy_numa *set, void *ptr)
+{
+    if (set == NULL || ptr == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_numa_free.\n");
+        return;
+    }
+
+    size_t i = pool_holding(set, ptr);
+    if (i == set->npools) {
+        fprintf(stderr, "Error: Pointer is out of bounds in buddy_numa_free.\n");
+        return;
+    }
+    buddy_free(set->pools[i], ptr);
+}
+
+
+int buddy_numa_node_of(struct buddy_numa *set, void *ptr)
+{
+    size_t i = pool_holding(set, ptr);
+    return i == set->npools ? -1 : set->node[i];
+}
+
+
+void buddy_numa_destroy(struct buddy_numa *set)
+{
+    for (size_t i = 0; i < set->npools; i++)
+    {
+        buddy_destroy(set->pools[i]);
+        munmap(set->pools[i], sizeof(struct buddy_pool));
+    }
+    memset(set, 0, sizeof(struct buddy_numa));
+}
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "lab.h"
+
+#define SLAB_BYTES (UINT64_C(1) << BUDDY_SLAB_K)
+
+/**
+* @brief Index of the lowest set bit of a non-zero word
+*/
+static inline size_t slab_ctz(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (size_t)__builtin_ctzll(word);
+#else
+    size_t i = 0;
+    while (!(word & 1))
+    {
+        word >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/**
+* @brief Index of the 2^BUDDY_SLAB_K block that holds ptr
+*/
+static inline size_t slab_index(struct buddy_slab_cache *cache, const void *ptr)
+{
+    return (size_t)((const unsigned char *)ptr - (const unsigned char *)cache->pool->base) >> BUDDY_SLAB_K;
+}
+
+/**
+* @brief The slab an object belongs to. Slabs are blocks of exactly
+* 2^BUDDY_SLAB_K so the block starts at the object's offset rounded down,
+* and the slab itself right after the block header.
+*/
+static inline struct buddy_slab *slab_of(struct buddy_slab_cache *cache, const void *ptr)
+{
+    unsigned char *block = (unsigned char *)cache->pool->base + (slab_index(cache, ptr) << BUDDY_SLAB_K);
+    return (struct buddy_slab *)(block + buddy_hdr_size(cache->pool));
+}
+
+/**
+* @brief True when ptr lies in a block the cache uses as a slab
+*/
+static inline bool slab_owned(struct buddy_slab_cache *cache, const void *ptr)
+{
+    const unsigned char *base = cache->pool->base;
+    size_t numbytes = __atomic_load_n(&cache->pool->numbytes, __ATOMIC_RELAXED);
+    if ((const unsigned char *)ptr < base || (const unsigned char *)ptr >= base + numbytes)
+    {
+        return false;
+    }
+    size_t i = slab_index(cache, ptr);
+    return (cache->owner[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void slab_set_owned(struct buddy_slab_cache *cache, const void *ptr, bool owned)
+{
+    size_t i = slab_index(cache, ptr);
+    if (owned)
+    {
+        cache->owner[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+    else
+    {
+        cache->owner[i / 64] &= ~(UINT64_C(1) << (i % 64));
+    }
+}
+
+/**
+* @brief Push a slab onto the front of the partial list of its class
+*/
+static inline void slab_push(struct buddy_slab **head, struct buddy_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static inline void slab_unlink(struct buddy_slab **head, struct buddy_slab *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *head = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+* @brief Take a block from the pool and lay out a slab of size byte objects in
+* it. The bitmap shares the block with the objects, so the number of objects
+* is the largest count whose bitmap and objects still fit.
+*/
+static struct buddy_slab *slab_new(struct buddy_slab_cache *cache, size_t size)
+{
+    size_t usable = SLAB_BYTES - buddy_hdr_size(cache->pool);
+    unsigned char *mem = buddy_malloc(cache->pool, usable);
+    if (mem == NULL)
+    {
+        return NULL;
+    }
+    struct buddy_slab *slab = (struct buddy_slab *)mem;
+    unsigned char *end = mem + usable;
+    size_t nslots = usable / size;
+    unsigned char *objects;
+    while (true)
+    {
+        size_t words = (nslots + 63) / 64;
+        uintptr_t start = (uintptr_t)(mem + offsetof(struct buddy_slab, free_map) + words * sizeof(uint64_t));
+        objects = (unsigned char *)((start + BUDDY_SLAB_ALIGN - 1) & ~(uintptr_t)(BUDDY_SLAB_ALIGN - 1));
+        if (objects + nslots * size <= end)
+        {
+            break;
+        }
+        nslots--;
+    }
+    slab->size = (unsigned int)size;
+    slab->nslots = (unsigned int)nslots;
+    slab->nfree = (unsigned int)nslots;
+    slab->hint = 0;
+    slab->objects = objects;
+    size_t words = (nslots + 63) / 64;
+    memset(slab->free_map, 0xff, words * sizeof(uint64_t));
+    if (nslots % 64)
+    {
+        slab->free_map[words - 1] = (UINT64_C(1) << (nslots % 64)) - 1;
+    }
+    slab_set_owned(cache, slab, true);
+    return slab;
+}
+
+static void slab_delete(struct buddy_slab_cache *cache, struct buddy_slab *slab)
+{
+    slab_set_owned(cache, slab, false);
+    buddy_free(cache->pool, slab);
+}
+
+
+void buddy_slab_init(struct buddy_slab_cache *cache, struct buddy_pool *pool)
+{
+    memset(cache, 0, sizeof(struct buddy_slab_cache));
+    cache->pool = pool;
+    //One bit for every slab sized block the pool can ever have
+    size_t bits = UINT64_C(1) << (pool->kval_max - BUDDY_SLAB_K);
+    cache->owner_bytes = ((bits + 63) / 64) * sizeof(uint64_t);
+    cache->owner = mmap(NULL, cache->owner_bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == cache->owner)
+    {
+        perror("buddy_slab_init owner bitmap mmap failed");
+        abort();
+    }
+}
+
+
+void *buddy_slab_malloc(struct buddy_slab_cache *cache, size_t size)
+{
+    if (cache == NULL || size == 0) {
+        fprintf(stderr, "Error: Invalid arguments passed to buddy_slab_malloc.\n");
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size > BUDDY_SLAB_MAX_SIZE) {
+        return buddy_malloc(cache->pool, size);
+    }
+
+    size_t cls = (size - 1) / BUDDY_SLAB_ALIGN;
+    struct buddy_slab *slab = cache->partial[cls];
+    if (slab == NULL) {
+        slab = slab_new(cache, (cls + 1) * BUDDY_SLAB_ALIGN);
+        if (slab == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        slab_push(&cache->partial[cls], slab);
+    }
+
+    // Words below the hint are known to be full
+    size_t w = slab->hint;
+    while (slab->free_map[w] == 0)
+    {
+        w++;
+    }
+    size_t bit = slab_ctz(slab->free_map[w]);
+    slab->free_map[w] &= slab->free_map[w] - 1;
+    slab->hint = (unsigned int)w;
+    if (--slab->nfree == 0) {
+        slab_unlink(&cache->partial[cls], slab);
+    }
+    return slab->objects + (w * 64 + bit) * slab->size;
+}
+
+
+void buddy_slab_free(struct buddy_slab_cache *cache, void *ptr)
+{
+    if (cache == NULL || ptr == NULL) {
+        fprintf(stderr, "Error: Null pointer passed to buddy_slab_free.\n");
+        return;
+    }
+    if (!slab_owned(cache, ptr)) {
+        buddy_free(cache->pool, ptr);
+        return;
+    }
+
+    struct buddy_slab *slab = slab_of(cache, ptr);
+    size_t offset = (size_t)((unsigned char *)ptr - slab->objects);
+    size_t i = offset / slab->size;
+    if ((unsigned char *)ptr < slab->objects || offset % slab->size != 0 || i >= slab->nslots ||
+        ((slab->free_map[i / 64] >> (i % 64)) & 1)) {
+        fprintf(stderr, "Error: Pointer was not allocated by buddy_slab_malloc in buddy_slab_free.\n");
+        return;
+    }
+    slab->free_map[i / 64] |= UINT64_C(1) << (i % 64);
+    if (i / 64 < slab->hint) {
+        slab->hint = (unsigned int)(i / 64);
+    }
+
+    size_t cls = slab->size / BUDDY_SLAB_ALIGN - 1;
+    if (slab->nfree++ == 0) {
+        slab_push(&cache->partial[cls], slab);
+    }
+    // Keep one slab per class around so a class that keeps emptying and
+    // refilling a slab does not go back to the pool every time
+    if (slab->nfree == slab->nslots && (slab->prev != NULL || slab->next != NULL)) {
+        slab_unlink(&cache->partial[cls], slab);
+        slab_delete(cache, slab);
+    }
+}
+
+
+void buddy_slab_destroy(struct buddy_slab_cache *cache)
+{
+    //Full slabs are not on any list, so walk the owner bitmap instead
+    size_t words = cache->owner_bytes / sizeof(uint64_t);
+    size_t slabs = cache->pool->numbytes >> BUDDY_SLAB_K;
+    for (size_t w = 0; w < words && w * 64 < slabs; w++)
+    {
+        uint64_t bits = cache->owner[w];
+        while (bits != 0)
+        {
+            size_t i = w * 64 + slab_ctz(bits);
+            bits &= bits - 1;
+            unsigned char *block = (unsigned char *)cache->pool->base + (i << BUDDY_SLAB_K);
+            buddy_free(cache->pool, block + buddy_hdr_size(cache->pool));
+        }
+    }
+    munmap(cache->owner, cache->owner_bytes);
+    memset(cache, 0, sizeof(struct buddy_slab_cache));
+}
@@ -1,6 +1,14 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -19,6 +27,17 @@ void tearDown(void) {
 */
 void check_buddy_pool_full(struct buddy_pool *pool)
 {
+  //A lock-free pool only has its bitmaps, with one bit set for the base block
+  if (pool->flags & BUDDY_LOCKFREE)
+  {
+    for (size_t i = 0; i < pool->kval_m; i++)
+    {
+      assert(pool->nfree[i] == 0);
+    }
+    assert(pool->nfree[pool->kval_m] == 1);
+    assert(pool->free_map[pool->kval_m][0] == 1);
+    return;
+  }
 //A full pool should have all values 0-(kval-1) as empty
   for (size_t i = 0; i < pool->kval_m; i++)
   {
@@ -52,7 +71,7 @@ void check_buddy_pool_empty(struct buddy_pool *pool)
 }
 /**
 * Test allocating 1 byte to make sure we split the blocks all the way down
-* to MIN_K size. Then free the block and ensure we end up with a full
+* to SMALLEST_K size. Then free the block and ensure we end up with a full
 * memory pool again
 */
 void test_buddy_malloc_one_byte(void)
@@ -64,6 +83,9 @@ void test_buddy_malloc_one_byte(void)
   buddy_init(&pool, size);
   void *mem = buddy_malloc(&pool, 1);
   //Make sure correct kval was allocated
+  struct buddy_header *tmp = (struct buddy_header *)mem - 1;
+  assert(tmp->kval == SMALLEST_K);
+  assert(tmp->tag == BLOCK_RESERVED);
   buddy_free(&pool, mem);
   check_buddy_pool_full(&pool);
   buddy_destroy(&pool);
@@ -81,11 +103,11 @@ void test_buddy_malloc_one_large(void)
   buddy_init(&pool, bytes);
   //Ask for an exact K value to be allocated. This test makes assumptions on
   //the internal details of buddy_init.
-  size_t ask = bytes - sizeof(struct avail);
+  size_t ask = bytes - sizeof(struct buddy_header);
   void *mem = buddy_malloc(&pool, ask);
   assert(mem != NULL);
   //Move the pointer back and make sure we got what we expected
-  struct avail *tmp = (struct avail *)mem - 1;
+  struct buddy_header *tmp = (struct buddy_header *)mem - 1;
   assert(tmp->kval == MIN_K);
   assert(tmp->tag == BLOCK_RESERVED);
   check_buddy_pool_empty(&pool);
@@ -186,6 +208,28 @@ void test_btok_large_values(void) {
   fprintf(stderr, "Passed large values test\n");
 }
 
+/**
+* Compare btok against the definition bytes <= 2^K around every power of two.
+*/
+void test_btok_boundaries(void) {
+  fprintf(stderr, "->Testing btok around every power of two\n");
+  assert(btok(0) == 0);
+  for (size_t k = 1; k < 63; k++)
+  {
+    size_t p = (size_t)1 << k;
+    assert(btok(p - 1) == (k == 1 ? 0 : k));
+    assert(btok(p) == k);
+    assert(btok(p + 1) == k + 1);
+  }
+  for (size_t bytes = 1; bytes < (UINT64_C(1) << 16); bytes++)
+  {
+    size_t k = btok(bytes);
+    assert((UINT64_C(1) << k) >= bytes);
+    assert(k == 0 || (UINT64_C(1) << (k - 1)) < bytes);
+  }
+  fprintf(stderr, "Passed power of two boundary test\n");
+}
+
 /**
  * Test buddy_calc with a valid buddy in the middle of the pool.
  */
@@ -380,6 +424,2130 @@ void test_buddy_malloc_non_power_of_two(void) {
   buddy_destroy(&pool);
 }
 
+/**
+* Fill a MIN_K pool with the smallest possible objects. Every SMALLEST_K block
+* should be usable, then freeing them in a scrambled order must coalesce the
+* pool back to a single block.
+*/
+void test_buddy_malloc_fill_smallest(void)
+{
+  fprintf(stderr, "->Testing filling the pool with SMALLEST_K blocks\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  size_t count = UINT64_C(1) << (MIN_K - SMALLEST_K);
+  void **ptrs = calloc(count, sizeof(void *));
+  assert(ptrs != NULL);
+  for (size_t i = 0; i < count; i++)
+  {
+    ptrs[i] = buddy_malloc(&pool, 1);
+    assert(ptrs[i] != NULL);
+  }
+  check_buddy_pool_empty(&pool);
+  assert(buddy_malloc(&pool, 1) == NULL);
+  assert(errno == ENOMEM);
+  for (size_t i = count; i > 1; i--)
+  {
+    size_t j = (size_t)rand() % i;
+    void *tmp = ptrs[i - 1];
+    ptrs[i - 1] = ptrs[j];
+    ptrs[j] = tmp;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    buddy_free(&pool, ptrs[i]);
+  }
+  check_buddy_pool_full(&pool);
+  free(ptrs);
+  buddy_destroy(&pool);
+}
+
+/**
+* Freeing a block must not merge it with a buddy that is still allocated.
+*/
+void test_buddy_free_keeps_reserved_buddy(void)
+{
+  fprintf(stderr, "->Testing buddy_free does not coalesce reserved buddies\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  void *a = buddy_malloc(&pool, 1);
+  void *b = buddy_malloc(&pool, 1);
+  assert(a != NULL && b != NULL);
+  buddy_free(&pool, a);
+  struct buddy_header *hb = (struct buddy_header *)b - 1;
+  assert(hb->tag == BLOCK_RESERVED);
+  assert(hb->kval == SMALLEST_K);
+  assert((void *)pool.avail[SMALLEST_K].next == (void *)((struct buddy_header *)a - 1));
+  buddy_free(&pool, b);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A pointer into the middle of an allocated block is not aligned to the
+* block's size and must be rejected without touching the pool.
+*/
+void test_buddy_free_misaligned_pointer(void)
+{
+  fprintf(stderr, "->Testing buddy_free with a misaligned pointer\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  unsigned char *mem = buddy_malloc(&pool, 1000);
+  assert(mem != NULL);
+  //Forge a header inside the block that claims to be a reserved block
+  struct buddy_header *fake = (struct buddy_header *)(mem + 64);
+  fake->tag = BLOCK_RESERVED;
+  fake->kval = 10;
+  buddy_free(&pool, fake + 1);
+  assert(((struct buddy_header *)mem - 1)->tag == BLOCK_RESERVED);
+  buddy_free(&pool, mem);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* The occupancy mask must mirror which avail lists are non-empty.
+*/
+void test_buddy_avail_mask(void)
+{
+  fprintf(stderr, "->Testing the avail occupancy mask\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  assert(pool.avail_mask == UINT64_C(1) << MIN_K);
+  void *mem = buddy_malloc(&pool, 1);
+  assert(mem != NULL);
+  //Splitting leaves one free block in every class from SMALLEST_K to MIN_K-1
+  uint64_t split = (UINT64_C(1) << MIN_K) - (UINT64_C(1) << SMALLEST_K);
+  assert(pool.avail_mask == split);
+  for (size_t i = 0; i <= pool.kval_m; i++)
+  {
+    bool nonempty = pool.avail[i].next != &pool.avail[i];
+    assert(nonempty == ((pool.avail_mask >> i) & 1));
+  }
+  buddy_free(&pool, mem);
+  assert(pool.avail_mask == UINT64_C(1) << MIN_K);
+  mem = buddy_malloc(&pool, (UINT64_C(1) << MIN_K) - sizeof(struct buddy_header));
+  assert(mem != NULL);
+  assert(pool.avail_mask == 0);
+  buddy_free(&pool, mem);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* buddy_realloc with a NULL pointer behaves like malloc and with a size of
+* zero behaves like free.
+*/
+void test_buddy_realloc_malloc_and_free(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc NULL pointer and zero size\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  void *mem = buddy_realloc(&pool, NULL, 100);
+  assert(mem != NULL);
+  assert(((struct buddy_header *)mem - 1)->tag == BLOCK_RESERVED);
+  assert(buddy_realloc(&pool, mem, 0) == NULL);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Shrinking keeps the pointer and returns the upper halves to the pool.
+*/
+void test_buddy_realloc_shrink_in_place(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc shrinking in place\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  unsigned char *mem = buddy_malloc(&pool, 4000);
+  assert(mem != NULL);
+  assert(((struct buddy_header *)mem - 1)->kval == 12);
+  memset(mem, 0xab, 40);
+  unsigned char *small = buddy_realloc(&pool, mem, 40);
+  assert(small == mem);
+  assert(((struct buddy_header *)small - 1)->kval == SMALLEST_K);
+  for (size_t i = 0; i < 40; i++)
+  {
+    assert(small[i] == 0xab);
+  }
+  //Every class between the new and old size now has the freed tail
+  for (size_t i = SMALLEST_K; i < 12; i++)
+  {
+    assert(pool.avail[i].next != &pool.avail[i]);
+  }
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Growing a block whose upper buddies are free must not move it.
+*/
+void test_buddy_realloc_grow_in_place(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc growing in place\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  unsigned char *mem = buddy_malloc(&pool, 1);
+  assert(mem != NULL);
+  mem[0] = 42;
+  unsigned char *big = buddy_realloc(&pool, mem, 100000);
+  assert(big == mem);
+  assert(big[0] == 42);
+  assert(((struct buddy_header *)big - 1)->kval == 17);
+  buddy_free(&pool, big);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Growing a block whose buddy is allocated has to move the data.
+*/
+void test_buddy_realloc_grow_copy(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc growing by copying\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  unsigned char *a = buddy_malloc(&pool, 1);
+  unsigned char *b = buddy_malloc(&pool, 1);
+  assert(a != NULL && b != NULL);
+  for (size_t i = 0; i < 40; i++)
+  {
+    a[i] = (unsigned char)i;
+  }
+  unsigned char *grown = buddy_realloc(&pool, a, 1000);
+  assert(grown != NULL && grown != a);
+  for (size_t i = 0; i < 40; i++)
+  {
+    assert(grown[i] == (unsigned char)i);
+  }
+  //A request that can never fit leaves the original block alone
+  assert(buddy_realloc(&pool, b, UINT64_C(1) << MIN_K) == NULL);
+  assert(errno == ENOMEM);
+  assert(((struct buddy_header *)b - 1)->tag == BLOCK_RESERVED);
+  //Even one that wraps around when the header is added
+  errno = 0;
+  assert(buddy_realloc(&pool, b, SIZE_MAX - 3) == NULL);
+  assert(errno == ENOMEM);
+  assert(buddy_block_kval(&pool, b) == SMALLEST_K);
+  buddy_free(&pool, grown);
+  buddy_free(&pool, b);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A grow that runs into an allocated buddy part way up gives back what it
+* claimed before trying to move.
+*/
+void test_buddy_realloc_grow_partial(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc giving back a partial grow\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  size_t hdr = sizeof(struct buddy_header);
+  void *q0 = buddy_malloc(&pool, (UINT64_C(1) << (MIN_K - 2)) - hdr);
+  void *q1 = buddy_malloc(&pool, (UINT64_C(1) << (MIN_K - 2)) - hdr);
+  void *h = buddy_malloc(&pool, (UINT64_C(1) << (MIN_K - 1)) - hdr);
+  assert(q0 != NULL && q1 != NULL && h != NULL);
+  buddy_free(&pool, q0);
+  unsigned char *a = buddy_malloc(&pool, 1);
+  assert(a == q0);
+  a[0] = 0x77;
+  size_t largest = buddy_largest_free(&pool);
+  assert(largest == (UINT64_C(1) << (MIN_K - 3)) - hdr);
+
+  //The buddies up to a quarter are free but q1 is in the way and there
+  //is nowhere to move to
+  assert(buddy_realloc(&pool, a, UINT64_C(1) << (MIN_K - 2)) == NULL);
+  assert(errno == ENOMEM);
+  assert(buddy_largest_free(&pool) == largest);
+  assert(buddy_block_kval(&pool, a) == SMALLEST_K);
+  assert(a[0] == 0x77);
+
+  buddy_free(&pool, a);
+  buddy_free(&pool, q1);
+  buddy_free(&pool, h);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+#define STRESS_THREADS 4
+#define STRESS_OPS 20000
+#define STRESS_SLOTS 64
+
+struct stress_arg
+{
+  struct buddy_pool *pool;
+  struct buddy_arena *arena; /*Used instead of pool when set*/
+  unsigned int seed;
+  unsigned char id;
+};
+
+static void *stress_malloc(struct stress_arg *arg, size_t size)
+{
+  return arg->arena ? buddy_arena_malloc(arg->arena, size) : buddy_malloc(arg->pool, size);
+}
+
+static void stress_free(struct stress_arg *arg, void *ptr)
+{
+  if (arg->arena)
+  {
+    buddy_arena_free(arg->arena, ptr);
+  }
+  else
+  {
+    buddy_free(arg->pool, ptr);
+  }
+}
+
+/**
+* Worker for the concurrent stress test. Each thread keeps a few live blocks
+* filled with its own id and checks the pattern before freeing them, so any
+* block handed to two threads at once is detected.
+*/
+static void *stress_worker(void *argp)
+{
+  struct stress_arg *arg = argp;
+  unsigned char *slots[STRESS_SLOTS] = {0};
+  size_t sizes[STRESS_SLOTS] = {0};
+  for (size_t op = 0; op < STRESS_OPS; op++)
+  {
+    size_t i = (size_t)rand_r(&arg->seed) % STRESS_SLOTS;
+    if (slots[i] != NULL)
+    {
+      for (size_t j = 0; j < sizes[i]; j++)
+      {
+        assert(slots[i][j] == arg->id);
+      }
+      stress_free(arg, slots[i]);
+      slots[i] = NULL;
+      continue;
+    }
+    size_t size = 1 + (size_t)rand_r(&arg->seed) % ((rand_r(&arg->seed) % 8) ? 256 : 16384);
+    slots[i] = stress_malloc(arg, size);
+    if (slots[i] != NULL)
+    {
+      memset(slots[i], arg->id, size);
+      sizes[i] = size;
+    }
+  }
+  for (size_t i = 0; i < STRESS_SLOTS; i++)
+  {
+    if (slots[i] != NULL)
+    {
+      stress_free(arg, slots[i]);
+    }
+  }
+  return NULL;
+}
+
+/**
+* Run STRESS_THREADS stress workers against pool and make sure every block is
+* returned and coalesced once they are done. When arena is set the workers
+* go through it instead, and pool is its first region.
+*/
+static void run_stress(struct buddy_pool *pool, struct buddy_arena *arena)
+{
+  pthread_t threads[STRESS_THREADS];
+  struct stress_arg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++)
+  {
+    args[t].pool = pool;
+    args[t].arena = arena;
+    args[t].seed = (unsigned int)rand();
+    args[t].id = (unsigned char)(t + 1);
+    assert(pthread_create(&threads[t], NULL, stress_worker, &args[t]) == 0);
+  }
+  for (int t = 0; t < STRESS_THREADS; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+  assert(arena == NULL || arena->nregions == 1);
+  //Only pools that may leave free buddies unmerged need compacting, an
+  //eager pool has to have coalesced everything on its own
+  if (pool->flags & (BUDDY_LAZY | BUDDY_LOCKFREE))
+  {
+    buddy_compact(pool);
+  }
+  else
+  {
+    assert(buddy_compact(pool) == 0);
+  }
+  check_buddy_pool_full(pool);
+  struct buddy_stats stats;
+  buddy_stats(pool, &stats);
+  assert(stats.allocs == stats.frees);
+  assert(stats.bytes_in_use == 0);
+  assert(stats.bytes_free == stats.pool_bytes);
+}
+
+/**
+* Hammer a concurrent pool from several threads.
+*/
+void test_buddy_concurrent_stress(void)
+{
+  fprintf(stderr, "->Testing a concurrent pool from %d threads\n", STRESS_THREADS);
+  struct buddy_pool pool;
+  buddy_init_concurrent(&pool, UINT64_C(1) << 24);
+  run_stress(&pool, NULL);
+  buddy_destroy(&pool);
+}
+
+/**
+* A freed block stays in the magazine and is handed straight back by the
+* next allocation of the same class. Flushing returns everything.
+*/
+void test_buddy_cache_reuse(void)
+{
+  fprintf(stderr, "->Testing buddy_cache reuses freed blocks\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  struct buddy_cache cache;
+  buddy_cache_init(&cache, &pool, 8);
+  void *a = buddy_cache_malloc(&cache, 100);
+  assert(a != NULL);
+  //The first miss refills half a magazine from the pool
+  assert(cache.mags[btok(100 + sizeof(struct buddy_header))].count == 3);
+  buddy_cache_free(&cache, a);
+  void *b = buddy_cache_malloc(&cache, 100);
+  assert(b == a);
+  buddy_cache_free(&cache, b);
+  buddy_cache_flush(&cache);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A magazine never holds more than depth blocks and large requests bypass the
+* cache entirely.
+*/
+void test_buddy_cache_depth(void)
+{
+  fprintf(stderr, "->Testing buddy_cache magazine depth\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  struct buddy_cache cache;
+  buddy_cache_init(&cache, &pool, 4);
+  void *ptrs[20];
+  for (size_t i = 0; i < 20; i++)
+  {
+    ptrs[i] = buddy_malloc(&pool, 1);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < 20; i++)
+  {
+    buddy_cache_free(&cache, ptrs[i]);
+    assert(cache.mags[SMALLEST_K].count <= 4);
+  }
+  void *big = buddy_cache_malloc(&cache, UINT64_C(1) << BUDDY_CACHE_MAX_K);
+  assert(big != NULL);
+  assert(((struct buddy_header *)big - 1)->kval == BUDDY_CACHE_MAX_K + 1);
+  buddy_cache_free(&cache, big);
+  buddy_cache_flush(&cache);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Allocated blocks only carry an 8 byte header, so a request of exactly
+* 2^K - 8 bytes fits in a 2^K block for every K.
+*/
+void test_buddy_header_size(void)
+{
+  fprintf(stderr, "->Testing the allocated block header size\n");
+  assert(sizeof(struct buddy_header) == 8);
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  for (size_t k = SMALLEST_K; k < MIN_K - 1; k++)
+  {
+    size_t ask = (UINT64_C(1) << k) - sizeof(struct buddy_header);
+    unsigned char *mem = buddy_malloc(&pool, ask);
+    assert(mem != NULL);
+    assert(((struct buddy_header *)mem - 1)->kval == k);
+    memset(mem, 0xff, ask);
+    unsigned char *next = buddy_malloc(&pool, ask + 1);
+    assert(next != NULL);
+    assert(((struct buddy_header *)next - 1)->kval == k + 1);
+    buddy_free(&pool, mem);
+    buddy_free(&pool, next);
+    check_buddy_pool_full(&pool);
+  }
+  buddy_destroy(&pool);
+}
+
+/**
+* Blocks of a header free pool are exactly a power of two and aligned to
+* their size, so the pool holds one object per SMALLEST_K block.
+*/
+void test_buddy_noheader_layout(void)
+{
+  fprintf(stderr, "->Testing a header free pool layout\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_NOHEADER);
+  check_buddy_pool_full(&pool);
+  unsigned char *page = buddy_malloc(&pool, 4096);
+  assert(page != NULL);
+  assert(((unsigned char *)page - (unsigned char *)pool.base) % 4096 == 0);
+  assert(buddy_block_kval(&pool, page) == 12);
+  unsigned char *small = buddy_malloc(&pool, 64);
+  assert(small != NULL);
+  assert(((unsigned char *)small - (unsigned char *)pool.base) % 64 == 0);
+  assert(buddy_block_kval(&pool, small) == SMALLEST_K);
+  //Interior pointers and double frees are rejected
+  assert(buddy_block_kval(&pool, page + 64) == 0);
+  buddy_free(&pool, page + 64);
+  buddy_free(&pool, small);
+  buddy_free(&pool, small);
+  buddy_free(&pool, page);
+  check_buddy_pool_full(&pool);
+
+  size_t count = UINT64_C(1) << (MIN_K - SMALLEST_K);
+  void **ptrs = calloc(count, sizeof(void *));
+  assert(ptrs != NULL);
+  for (size_t i = 0; i < count; i++)
+  {
+    ptrs[i] = buddy_malloc(&pool, 64);
+    assert(ptrs[i] != NULL);
+  }
+  assert(buddy_malloc(&pool, 1) == NULL);
+  for (size_t i = count; i > 1; i--)
+  {
+    size_t j = (size_t)rand() % i;
+    void *tmp = ptrs[i - 1];
+    ptrs[i - 1] = ptrs[j];
+    ptrs[j] = tmp;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    buddy_free(&pool, ptrs[i]);
+  }
+  check_buddy_pool_full(&pool);
+  free(ptrs);
+  buddy_destroy(&pool);
+}
+
+/**
+* Freeing a block of a header free pool must not touch its allocated buddy,
+* which is checked by making the buddy inaccessible.
+*/
+void test_buddy_noheader_free_skips_buddy(void)
+{
+  fprintf(stderr, "->Testing header free coalescing only reads the bitmaps\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_NOHEADER);
+  void *a = buddy_malloc(&pool, 4096);
+  void *b = buddy_malloc(&pool, 4096);
+  assert(a != NULL && b != NULL);
+  assert((unsigned char *)b == (unsigned char *)a + 4096);
+  assert(mprotect(b, 4096, PROT_NONE) == 0);
+  buddy_free(&pool, a);
+  assert(mprotect(b, 4096, PROT_READ | PROT_WRITE) == 0);
+  buddy_free(&pool, b);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* buddy_realloc grows and shrinks in place in a header free pool too.
+*/
+void test_buddy_noheader_realloc(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc in a header free pool\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_NOHEADER);
+  unsigned char *mem = buddy_malloc(&pool, 64);
+  memset(mem, 7, 64);
+  unsigned char *big = buddy_realloc(&pool, mem, 65536);
+  assert(big == mem);
+  assert(buddy_block_kval(&pool, big) == 16);
+  unsigned char *small = buddy_realloc(&pool, big, 100);
+  assert(small == mem);
+  assert(buddy_block_kval(&pool, small) == 7);
+  for (size_t i = 0; i < 64; i++)
+  {
+    assert(small[i] == 7);
+  }
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A concurrent header free pool under the same stress as the header pool.
+*/
+void test_buddy_noheader_concurrent_stress(void)
+{
+  fprintf(stderr, "->Testing a concurrent header free pool\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << 24, BUDDY_CONCURRENT | BUDDY_NOHEADER);
+  run_stress(&pool, NULL);
+  buddy_destroy(&pool);
+}
+
+/**
+* Magazines work on header free pools, linking cached blocks through the
+* start of the block itself.
+*/
+void test_buddy_cache_noheader(void)
+{
+  fprintf(stderr, "->Testing buddy_cache on a header free pool\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_NOHEADER);
+  struct buddy_cache cache;
+  buddy_cache_init(&cache, &pool, 8);
+  void *a = buddy_cache_malloc(&cache, 64);
+  assert(a != NULL);
+  assert(buddy_block_kval(&pool, a) == SMALLEST_K);
+  buddy_cache_free(&cache, a);
+  assert(buddy_cache_malloc(&cache, 64) == a);
+  buddy_cache_free(&cache, a);
+  buddy_cache_flush(&cache);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* The pool is mapped aligned to its own size so block offsets are absolute
+* alignments.
+*/
+void test_buddy_init_base_alignment(void)
+{
+  fprintf(stderr, "->Testing the pool base is aligned to the pool size\n");
+  for (size_t k = MIN_K; k <= 24; k++)
+  {
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << k);
+    assert(((uintptr_t)pool.base & (pool.numbytes - 1)) == 0);
+    buddy_destroy(&pool);
+  }
+}
+
+/**
+* Aligned allocations from a pool with headers land on the requested
+* boundary, keep a usable header in front and free cleanly.
+*/
+void test_buddy_aligned_alloc(void)
+{
+  fprintf(stderr, "->Testing buddy_aligned_alloc\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << 24);
+  static const size_t aligns[] = {8, 16, 64, 4096, UINT64_C(1) << 21};
+  void *ptrs[5];
+  for (size_t i = 0; i < 5; i++)
+  {
+    ptrs[i] = buddy_aligned_alloc(&pool, aligns[i], 1000);
+    assert(ptrs[i] != NULL);
+    assert(((uintptr_t)ptrs[i] & (aligns[i] - 1)) == 0);
+    memset(ptrs[i], 0x5a, 1000);
+  }
+  //A 4 KiB aligned request needs 4 KiB in front for the header
+  assert(buddy_block_kval(&pool, ptrs[3]) == 13);
+  void *moved = buddy_realloc(&pool, ptrs[2], 5000);
+  assert(moved != NULL);
+  assert(((unsigned char *)moved)[999] == 0x5a);
+  ptrs[2] = moved;
+  for (size_t i = 0; i < 5; i++)
+  {
+    buddy_free(&pool, ptrs[i]);
+  }
+  check_buddy_pool_full(&pool);
+  errno = 0;
+  assert(buddy_aligned_alloc(&pool, 48, 10) == NULL);
+  assert(errno == EINVAL);
+  assert(buddy_aligned_alloc(&pool, UINT64_C(1) << 24, 10) == NULL);
+  assert(errno == ENOMEM);
+  buddy_destroy(&pool);
+}
+
+/**
+* An aligned allocation stays put while the new size fits behind it and is
+* moved otherwise, without ever absorbing its buddies.
+*/
+void test_buddy_aligned_realloc(void)
+{
+  fprintf(stderr, "->Testing buddy_realloc of aligned allocations\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct buddy_header);
+
+  unsigned char *p = buddy_aligned_alloc(&pool, 64, 100);
+  assert(p != NULL);
+  memset(p, 0x5a, 100);
+  unsigned char *q = buddy_realloc(&pool, p, UINT64_C(1) << (MIN_K - 2));
+  assert(q != NULL && q != p);
+  assert(q[0] == 0x5a && q[99] == 0x5a);
+  assert(buddy_largest_free(&pool) == half);
+  buddy_free(&pool, q);
+  check_buddy_pool_full(&pool);
+
+  //16 KiB block with the data 4 KiB in
+  p = buddy_aligned_alloc(&pool, 4096, 8192);
+  assert(p != NULL);
+  assert(buddy_block_kval(&pool, p) == 14);
+  memset(p, 0x3c, 8192);
+  assert(buddy_realloc(&pool, p, 16) == p);
+  assert(buddy_realloc(&pool, p, 12288) == p);
+  assert(buddy_block_kval(&pool, p) == 14);
+  assert(buddy_largest_free(&pool) == half);
+  q = buddy_realloc(&pool, p, 12289);
+  assert(q != NULL && q != p);
+  assert(q[0] == 0x3c && q[8191] == 0x3c);
+  buddy_free(&pool, q);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A header free pool hands out exactly the aligned block with no extra space.
+*/
+void test_buddy_aligned_alloc_noheader(void)
+{
+  fprintf(stderr, "->Testing buddy_aligned_alloc in a header free pool\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_NOHEADER);
+  void *small = buddy_malloc(&pool, 64);
+  void *page = buddy_aligned_alloc(&pool, 4096, 100);
+  assert(page != NULL);
+  assert(((uintptr_t)page & 4095) == 0);
+  assert(buddy_block_kval(&pool, page) == 12);
+  void *wide = buddy_aligned_alloc(&pool, 65536, 65536);
+  assert(((uintptr_t)wide & 65535) == 0);
+  assert(buddy_block_kval(&pool, wide) == 16);
+  buddy_free(&pool, page);
+  buddy_free(&pool, wide);
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Count the resident pages in [addr, addr + len) with mincore.
+*/
+static size_t resident_pages(void *addr, size_t len)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t n = (len + page - 1) / page;
+  unsigned char *vec = calloc(n, 1);
+  assert(mincore(addr, len, vec) == 0);
+  size_t resident = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    resident += vec[i] & 1;
+  }
+  free(vec);
+  return resident;
+}
+
+/**
+* Large free blocks give their pages back to the OS and come back zero
+* filled, small ones stay resident.
+*/
+void test_buddy_decommit(void)
+{
+  fprintf(stderr, "->Testing buddy_set_decommit\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << 24);
+  size_t page = pool.page_size;
+  assert(buddy_set_decommit(&pool, UINT64_C(1) << 20, MADV_DONTNEED) == 0);
+
+  unsigned char *small = buddy_malloc(&pool, 4096);
+  memset(small, 0xff, 4096);
+  unsigned char *big = buddy_malloc(&pool, UINT64_C(1) << 21);
+  memset(big, 0xff, UINT64_C(1) << 21);
+  struct avail *block = (struct avail *)((struct buddy_header *)big - 1);
+  assert(resident_pages(block, UINT64_C(1) << 21) == (UINT64_C(1) << 21) / page);
+  buddy_free(&pool, big);
+  //Everything but the page holding the free list links is gone
+  assert(resident_pages((unsigned char *)block + page, (UINT64_C(1) << 22) - page) == 0);
+
+  big = buddy_malloc(&pool, UINT64_C(1) << 21);
+  assert(big == (unsigned char *)block + sizeof(struct buddy_header));
+  assert(big[page] == 0 && big[(UINT64_C(1) << 21) - 1] == 0);
+  buddy_free(&pool, big);
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+
+  //Shrinking in place hands the tail back as well
+  big = buddy_malloc(&pool, UINT64_C(1) << 22);
+  memset(big, 0xff, UINT64_C(1) << 22);
+  assert(buddy_realloc(&pool, big, 1000) == big);
+  block = (struct avail *)((struct buddy_header *)big - 1);
+  assert(resident_pages((unsigned char *)block + (UINT64_C(1) << 21) + page, (UINT64_C(1) << 21) - page) == 0);
+  buddy_free(&pool, big);
+  check_buddy_pool_full(&pool);
+
+  errno = 0;
+  assert(buddy_set_decommit(&pool, 1, MADV_WILLNEED) == -1);
+  assert(errno == EINVAL);
+  assert(buddy_set_decommit(&pool, 0, MADV_DONTNEED) == 0);
+  assert(pool.decommit_k == 0);
+  buddy_destroy(&pool);
+}
+
+/**
+* Huge page backed pools either get the pages they asked for or fall back,
+* and behave like any other pool either way.
+*/
+void test_buddy_init_hugepages(void)
+{
+  fprintf(stderr, "->Testing huge page backed pools\n");
+  static const unsigned int modes[] = {BUDDY_HUGETLB, BUDDY_HUGETLB_1G, BUDDY_THP};
+  for (size_t m = 0; m < 3; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, modes[m]);
+    //Too small for explicit huge pages, at best THP is left
+    assert(!(pool.flags & (BUDDY_HUGETLB | BUDDY_HUGETLB_1G)));
+    if (pool.flags & BUDDY_THP)
+    {
+      assert(((uintptr_t)pool.base & ((UINT64_C(1) << 21) - 1)) == 0);
+    }
+    assert(pool.page_size == (size_t)sysconf(_SC_PAGESIZE));
+    buddy_destroy(&pool);
+
+    buddy_init_flags(&pool, UINT64_C(1) << 22, modes[m]);
+    if (pool.flags & BUDDY_HUGETLB)
+    {
+      assert(pool.page_size == UINT64_C(1) << 21);
+    }
+    assert(((uintptr_t)pool.base & (pool.numbytes - 1)) == 0);
+    unsigned char *mem = buddy_malloc(&pool, 100000);
+    assert(mem != NULL);
+    memset(mem, 0x11, 100000);
+    buddy_free(&pool, mem);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+  }
+}
+
+/**
+* Read a counter from /proc/meminfo, 0 when it is not there.
+*/
+static size_t meminfo(const char *key)
+{
+  FILE *f = fopen("/proc/meminfo", "r");
+  if (f == NULL)
+  {
+    return 0;
+  }
+  char line[128];
+  size_t len = strlen(key);
+  size_t value = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if (strncmp(line, key, len) == 0 && line[len] == ':')
+    {
+      value = (size_t)strtoull(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return value;
+}
+
+/**
+* A hugetlb pool only takes the huge pages it needs, so it gets them when
+* just that many are free. Does nothing unless 2 MiB huge pages are set up.
+*/
+void test_buddy_hugetlb_exact(void)
+{
+  fprintf(stderr, "->Testing a hugetlb pool takes only its own huge pages\n");
+  size_t free_pages = meminfo("HugePages_Free");
+  if (meminfo("Hugepagesize") != 2048 || free_pages == 0)
+  {
+    return;
+  }
+  //The largest pool that fits, mapping twice its size would not
+  size_t pages = 1;
+  while (pages * 2 <= free_pages)
+  {
+    pages *= 2;
+  }
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, pages << 21, BUDDY_HUGETLB);
+  assert(pool.flags & BUDDY_HUGETLB);
+  assert(pool.page_size == UINT64_C(1) << 21);
+  assert(((uintptr_t)pool.base & (pool.numbytes - 1)) == 0);
+  unsigned char *mem = buddy_malloc(&pool, 100000);
+  assert(mem != NULL);
+  memset(mem, 0x22, 100000);
+  buddy_free(&pool, mem);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* An arena maps more regions as it fills up and unmaps them once empty.
+*/
+void test_buddy_arena_grow(void)
+{
+  fprintf(stderr, "->Testing an arena grows and shrinks\n");
+  struct buddy_arena arena;
+  buddy_arena_init(&arena, UINT64_C(1) << MIN_K, 0);
+  assert(arena.nregions == 1);
+  //Each takes a 128 KiB block, so 8 fit in a region
+  unsigned char *ptrs[40];
+  for (size_t i = 0; i < 40; i++)
+  {
+    ptrs[i] = buddy_arena_malloc(&arena, 100000);
+    assert(ptrs[i] != NULL);
+    memset(ptrs[i], (int)i, 100000);
+  }
+  assert(arena.nregions == 5);
+  for (size_t i = 0; i < 40; i++)
+  {
+    assert(ptrs[i][99999] == (unsigned char)i);
+    buddy_arena_free(&arena, ptrs[i]);
+  }
+  assert(arena.nregions == 1);
+  check_buddy_pool_full(arena.regions[0]);
+
+  //A request bigger than a region gets one of its own
+  unsigned char *big = buddy_arena_malloc(&arena, UINT64_C(1) << 22);
+  assert(big != NULL);
+  assert(arena.nregions == 2);
+  assert(arena.regions[1]->kval_m == 23);
+  big[(UINT64_C(1) << 22) - 1] = 1;
+  buddy_arena_free(&arena, big);
+  assert(arena.nregions == 1);
+  buddy_arena_destroy(&arena);
+}
+
+/**
+* Realloc moves a block to another region when its own one is full.
+*/
+void test_buddy_arena_realloc(void)
+{
+  fprintf(stderr, "->Testing buddy_arena_realloc across regions\n");
+  struct buddy_arena arena;
+  buddy_arena_init(&arena, UINT64_C(1) << MIN_K, 0);
+  unsigned char *a = buddy_arena_malloc(&arena, 400000);
+  unsigned char *b = buddy_arena_malloc(&arena, 400000);
+  memset(a, 0x3c, 400000);
+  assert(arena.nregions == 1);
+  unsigned char *c = buddy_arena_realloc(&arena, a, 700000);
+  assert(c != NULL && c != a);
+  assert(arena.nregions == 2);
+  assert(c[0] == 0x3c && c[399999] == 0x3c);
+  //Shrinking stays put
+  assert(buddy_arena_realloc(&arena, c, 1000) == c);
+  buddy_arena_free(&arena, b);
+  buddy_arena_free(&arena, c);
+  assert(arena.nregions == 1);
+  check_buddy_pool_full(arena.regions[0]);
+  buddy_arena_destroy(&arena);
+}
+
+/**
+* A lock-free region keeps no occupancy mask of its own, the arena still
+* sees its free blocks and does not map a region per request.
+*/
+void test_buddy_arena_lockfree(void)
+{
+  fprintf(stderr, "->Testing an arena of lock-free regions\n");
+  struct buddy_arena arena;
+  buddy_arena_init(&arena, UINT64_C(1) << MIN_K, BUDDY_LOCKFREE);
+  void *ptrs[200];
+  for (size_t i = 0; i < 200; i++)
+  {
+    ptrs[i] = buddy_arena_malloc(&arena, 64);
+    assert(ptrs[i] != NULL);
+    assert(arena.nregions == 1);
+  }
+  for (size_t i = 0; i < 200; i++)
+  {
+    buddy_arena_free(&arena, ptrs[i]);
+  }
+  //A region other than the first is released again once it is empty
+  void *big = buddy_arena_malloc(&arena, UINT64_C(1) << 22);
+  assert(big != NULL);
+  assert(arena.nregions == 2);
+  buddy_arena_free(&arena, big);
+  assert(arena.nregions == 1);
+  buddy_arena_destroy(&arena);
+}
+
+/**
+* A lazy region keeps freed blocks unmerged, it is still released once all
+* of them are free.
+*/
+void test_buddy_arena_lazy(void)
+{
+  fprintf(stderr, "->Testing an arena of lazy regions shrinks\n");
+  struct buddy_arena arena;
+  buddy_arena_init(&arena, UINT64_C(1) << MIN_K, BUDDY_LAZY);
+  //Each takes a 128 KiB block, so 8 fit in a region
+  void *ptrs[16];
+  for (size_t i = 0; i < 16; i++)
+  {
+    ptrs[i] = buddy_arena_malloc(&arena, 100000);
+    assert(ptrs[i] != NULL);
+  }
+  assert(arena.nregions == 2);
+  for (size_t i = 0; i < 16; i++)
+  {
+    buddy_arena_free(&arena, ptrs[i]);
+  }
+  assert(arena.nregions == 1);
+  buddy_arena_destroy(&arena);
+}
+
+/**
+* Several threads growing and shrinking a shared arena.
+*/
+void test_buddy_arena_concurrent(void)
+{
+  fprintf(stderr, "->Testing a concurrent arena from %d threads\n", STRESS_THREADS);
+  struct buddy_arena arena;
+  buddy_arena_init(&arena, UINT64_C(1) << MIN_K, BUDDY_CONCURRENT);
+  run_stress(arena.regions[0], &arena);
+  buddy_arena_destroy(&arena);
+}
+
+/**
+* A reserved pool doubles in place when it runs out and never moves blocks.
+*/
+void test_buddy_init_reserve(void)
+{
+  fprintf(stderr, "->Testing a pool that grows into reserved address space\n");
+  struct buddy_pool pool;
+  buddy_init_reserve(&pool, UINT64_C(1) << MIN_K, UINT64_C(1) << 24, 0);
+  assert(pool.kval_m == MIN_K);
+  assert(pool.kval_max == 24);
+  assert(((uintptr_t)pool.base & ((UINT64_C(1) << 24) - 1)) == 0);
+
+  unsigned char *a = buddy_malloc(&pool, 600000);
+  memset(a, 0xa5, 600000);
+  unsigned char *b = buddy_malloc(&pool, 600000);
+  assert(b != NULL);
+  assert(pool.kval_m == MIN_K + 1);
+  assert(pool.numbytes == UINT64_C(1) << (MIN_K + 1));
+  memset(b, 0x5a, 600000);
+  unsigned char *c = buddy_malloc(&pool, UINT64_C(1) << 22);
+  assert(c != NULL);
+  assert(pool.kval_m == 24);
+  assert(a[599999] == 0xa5 && b[0] == 0x5a);
+
+  errno = 0;
+  assert(buddy_malloc(&pool, UINT64_C(1) << 24) == NULL);
+  assert(errno == ENOMEM);
+  buddy_free(&pool, a);
+  buddy_free(&pool, c);
+  buddy_free(&pool, b);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  //Header free pools grow their bitmaps with them
+  buddy_init_reserve(&pool, UINT64_C(1) << MIN_K, 0, BUDDY_NOHEADER);
+  assert(pool.kval_max > 30);
+  a = buddy_malloc(&pool, UINT64_C(1) << 26);
+  assert(a != NULL);
+  assert(pool.kval_m == 26);
+  assert(buddy_block_kval(&pool, a) == 26);
+  a[(UINT64_C(1) << 26) - 1] = 1;
+  buddy_free(&pool, a);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Worker that holds sixteen 256 KiB blocks at once, so STRESS_THREADS of them
+* need more than a MIN_K pool.
+*/
+static void *grow_worker(void *argp)
+{
+  struct stress_arg *arg = argp;
+  unsigned char *held[16];
+  for (int round = 0; round < 20; round++)
+  {
+    for (size_t i = 0; i < 16; i++)
+    {
+      held[i] = buddy_malloc(arg->pool, 200000);
+      assert(held[i] != NULL);
+      memset(held[i], arg->id, 200000);
+    }
+    for (size_t i = 0; i < 16; i++)
+    {
+      assert(held[i][0] == arg->id && held[i][199999] == arg->id);
+      buddy_free(arg->pool, held[i]);
+    }
+  }
+  return NULL;
+}
+
+/**
+* Threads racing to grow a shared reserved pool.
+*/
+void test_buddy_init_reserve_concurrent(void)
+{
+  fprintf(stderr, "->Testing a concurrent pool that grows\n");
+  struct buddy_pool pool;
+  buddy_init_reserve(&pool, UINT64_C(1) << MIN_K, UINT64_C(1) << 26, BUDDY_CONCURRENT);
+  pthread_t threads[STRESS_THREADS];
+  struct stress_arg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++)
+  {
+    args[t].pool = &pool;
+    args[t].id = (unsigned char)(t + 1);
+    assert(pthread_create(&threads[t], NULL, grow_worker, &args[t]) == 0);
+  }
+  for (int t = 0; t < STRESS_THREADS; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+  assert(pool.kval_m > MIN_K + 2);
+  check_buddy_pool_full(&pool);
+  run_stress(&pool, NULL);
+  buddy_destroy(&pool);
+}
+
+/**
+* Count the blocks a slab cache currently owns
+*/
+static size_t slab_count(struct buddy_slab_cache *cache)
+{
+  size_t n = 0;
+  for (size_t w = 0; w < cache->owner_bytes / sizeof(uint64_t); w++)
+  {
+    n += (size_t)__builtin_popcountll(cache->owner[w]);
+  }
+  return n;
+}
+
+/**
+* Small objects come from slabs, are aligned and do not overlap.
+*/
+void test_buddy_slab_basic(void)
+{
+  fprintf(stderr, "->Testing slab allocations of every class\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << 22);
+  struct buddy_slab_cache cache;
+  buddy_slab_init(&cache, &pool);
+  unsigned char *ptrs[BUDDY_SLAB_MAX_SIZE + 1];
+  for (size_t size = 1; size <= BUDDY_SLAB_MAX_SIZE; size++)
+  {
+    ptrs[size] = buddy_slab_malloc(&cache, size);
+    assert(ptrs[size] != NULL);
+    assert(((uintptr_t)ptrs[size] & (BUDDY_SLAB_ALIGN - 1)) == 0);
+    memset(ptrs[size], (int)size, size);
+  }
+  assert(slab_count(&cache) == BUDDY_SLAB_CLASSES);
+  //Too big for a slab
+  unsigned char *big = buddy_slab_malloc(&cache, BUDDY_SLAB_MAX_SIZE + 1);
+  assert(buddy_block_kval(&pool, big) == 9);
+  for (size_t size = 1; size <= BUDDY_SLAB_MAX_SIZE; size++)
+  {
+    for (size_t j = 0; j < size; j++)
+    {
+      assert(ptrs[size][j] == (unsigned char)size);
+    }
+    buddy_slab_free(&cache, ptrs[size]);
+  }
+  buddy_slab_free(&cache, big);
+  //The last slab of each class is kept
+  assert(slab_count(&cache) == BUDDY_SLAB_CLASSES);
+  buddy_slab_destroy(&cache);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A class spread over many slabs gives the empty ones back to the pool.
+*/
+void test_buddy_slab_release(void)
+{
+  fprintf(stderr, "->Testing empty slabs go back to the pool\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << 22);
+  struct buddy_slab_cache cache;
+  buddy_slab_init(&cache, &pool);
+  size_t n = 20000;
+  void **ptrs = calloc(n, sizeof(void *));
+  for (size_t i = 0; i < n; i++)
+  {
+    ptrs[i] = buddy_slab_malloc(&cache, 24);
+    assert(ptrs[i] != NULL);
+    *(size_t *)ptrs[i] = i;
+  }
+  //32 byte objects pack about 2000 to a slab
+  assert(slab_count(&cache) == 10 || slab_count(&cache) == 11);
+  for (size_t i = 0; i < n; i += 2)
+  {
+    assert(*(size_t *)ptrs[i] == i);
+    buddy_slab_free(&cache, ptrs[i]);
+  }
+  //Freed slots are reused before new slabs are taken
+  size_t before = slab_count(&cache);
+  for (size_t i = 0; i < n; i += 2)
+  {
+    ptrs[i] = buddy_slab_malloc(&cache, 32);
+  }
+  assert(slab_count(&cache) == before);
+  for (size_t i = 0; i < n; i++)
+  {
+    buddy_slab_free(&cache, ptrs[i]);
+  }
+  assert(slab_count(&cache) == 1);
+  free(ptrs);
+  buddy_slab_destroy(&cache);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Batches are cut from sibling blocks and merge back when freed together.
+*/
+void test_buddy_batch(void)
+{
+  fprintf(stderr, "->Testing buddy_malloc_batch and buddy_free_batch\n");
+  static const unsigned int modes[] = {0, BUDDY_NOHEADER};
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, modes[m]);
+    void *ptrs[40];
+    assert(buddy_malloc_batch(&pool, 100, 24, ptrs) == 24);
+    for (size_t i = 0; i < 24; i++)
+    {
+      assert(buddy_block_kval(&pool, ptrs[i]) == 7);
+      memset(ptrs[i], (int)i, 100);
+    }
+    //The first 16 are one group of siblings
+    for (size_t i = 1; i < 16; i++)
+    {
+      assert((unsigned char *)ptrs[i] - (unsigned char *)ptrs[i - 1] == 128);
+    }
+    for (size_t i = 0; i < 24; i++)
+    {
+      assert(((unsigned char *)ptrs[i])[99] == (unsigned char)i);
+    }
+    //Mix in an unrelated block and a NULL, in no particular order
+    ptrs[24] = buddy_malloc(&pool, 5000);
+    ptrs[25] = NULL;
+    void *tmp = ptrs[3];
+    ptrs[3] = ptrs[20];
+    ptrs[20] = tmp;
+    buddy_free_batch(&pool, ptrs, 26);
+    check_buddy_pool_full(&pool);
+
+    //A batch that does not fit returns what it could get
+    errno = 0;
+    size_t got = buddy_malloc_batch(&pool, (UINT64_C(1) << 18) - 64, 10, ptrs);
+    assert(got == 4);
+    assert(errno == ENOMEM);
+    buddy_free_batch(&pool, ptrs, got);
+    check_buddy_pool_full(&pool);
+
+    //Nor one whose size wraps when the header is added
+    errno = 0;
+    assert(buddy_malloc_batch(&pool, SIZE_MAX - 3, 2, ptrs) == 0);
+    assert(errno == ENOMEM);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+  }
+}
+
+/**
+* Callers can learn and use the slack of the power of two blocks, and hand
+* the size back when freeing.
+*/
+void test_buddy_usable_size(void)
+{
+  fprintf(stderr, "->Testing buddy_usable_size and buddy_free_sized\n");
+  static const unsigned int modes[] = {0, BUDDY_NOHEADER};
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, modes[m]);
+    size_t hdr = (modes[m] & BUDDY_NOHEADER) ? 0 : sizeof(struct buddy_header);
+    size_t actual = 0;
+    unsigned char *a = buddy_malloc_at_least(&pool, 100, &actual);
+    assert(actual == 128 - hdr);
+    assert(buddy_usable_size(&pool, a) == actual);
+    memset(a, 1, actual);
+    unsigned char *b = buddy_malloc_at_least(&pool, 3000, &actual);
+    assert(actual == 4096 - hdr);
+    assert(buddy_usable_size(&pool, b) == actual);
+    unsigned char *c = buddy_aligned_alloc(&pool, 1024, 10);
+    //Aligned blocks can be used up to the end of the block
+    assert(buddy_usable_size(&pool, c) == 1024);
+    assert(buddy_usable_size(&pool, NULL) == 0);
+
+    //A size no block can have is reported instead of freeing the
+    //smallest class
+    buddy_free_sized(&pool, a, SIZE_MAX - 3);
+    assert(buddy_usable_size(&pool, a) == 128 - hdr);
+
+    //Any size in the block's class frees it
+    buddy_free_sized(&pool, a, 100);
+    buddy_free_sized(&pool, b, actual);
+    buddy_free(&pool, c);
+    check_buddy_pool_full(&pool);
+    assert(buddy_malloc_at_least(&pool, UINT64_C(1) << 21, &actual) == NULL);
+    buddy_destroy(&pool);
+  }
+}
+
+/**
+* True when len bytes at mem are all zero
+*/
+static bool all_zero(const unsigned char *mem, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (mem[i] != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+* buddy_calloc returns zeroed memory whether the block is fresh, was
+* written before, or was decommitted, and leaves fresh pages untouched.
+*/
+void test_buddy_calloc(void)
+{
+  fprintf(stderr, "->Testing buddy_calloc\n");
+  static const unsigned int modes[] = {0, BUDDY_NOHEADER};
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 24, modes[m]);
+    size_t page = pool.page_size;
+    size_t big = UINT64_C(1) << 22;
+
+    //Never handed out, so nothing is written
+    unsigned char *mem = buddy_calloc(&pool, 1, big);
+    unsigned char *block = (unsigned char *)((uintptr_t)mem & ~(uintptr_t)(page - 1));
+    assert(resident_pages(block + page, big - page) == 0);
+    assert(all_zero(mem, big));
+    memset(mem, 0xff, big);
+    buddy_free(&pool, mem);
+
+    //Dirty and large, cleared by dropping the pages
+    mem = buddy_calloc(&pool, big / 16, 16);
+    assert(resident_pages(block + page, big - 2 * page) == 0);
+    assert(all_zero(mem, big));
+    buddy_free(&pool, mem);
+
+    //Small blocks that were written and merged again
+    unsigned char *a = buddy_malloc(&pool, 40);
+    unsigned char *b = buddy_malloc(&pool, 40);
+    memset(a, 0xff, 40);
+    memset(b, 0xff, 40);
+    buddy_free(&pool, b);
+    buddy_free(&pool, a);
+    a = buddy_calloc(&pool, 10, 10);
+    assert(all_zero(a, 100));
+    b = buddy_calloc(&pool, 3, 1000);
+    assert(all_zero(b, 3000));
+    buddy_free(&pool, a);
+    buddy_free(&pool, b);
+
+    //Decommitted blocks only need their first page cleared
+    assert(buddy_set_decommit(&pool, UINT64_C(1) << 20, MADV_DONTNEED) == 0);
+    mem = buddy_malloc(&pool, big);
+    memset(mem, 0xff, big);
+    buddy_free(&pool, mem);
+    mem = buddy_calloc(&pool, 1, big);
+    assert(all_zero(mem, big));
+    buddy_free(&pool, mem);
+    check_buddy_pool_full(&pool);
+
+    errno = 0;
+    assert(buddy_calloc(&pool, SIZE_MAX / 2, 4) == NULL);
+    assert(errno == ENOMEM);
+    //Adding the header to these must not wrap around to a small block
+    errno = 0;
+    assert(buddy_calloc(&pool, 1, SIZE_MAX - 3) == NULL);
+    assert(errno == ENOMEM);
+    errno = 0;
+    assert(buddy_malloc(&pool, SIZE_MAX - 3) == NULL);
+    assert(errno == ENOMEM);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+  }
+}
+
+/**
+* A lazy pool hands a freed block straight back without merging and
+* splitting it again, keeps up to the watermark free blocks in a class and
+* only merges them on demand.
+*/
+void test_buddy_lazy(void)
+{
+  fprintf(stderr, "->Testing deferred coalescing\n");
+  static const unsigned int modes[] = {0, BUDDY_LAZY};
+  uint64_t splits[2];
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, modes[m]);
+    for (int i = 0; i < 100; i++)
+    {
+      void *mem = buddy_malloc(&pool, 40);
+      assert(mem != NULL);
+      buddy_free(&pool, mem);
+    }
+    splits[m] = pool.nsplit[SMALLEST_K];
+    buddy_destroy(&pool);
+  }
+  assert(splits[0] == 100);
+  assert(splits[1] == 1);
+
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_LAZY);
+  assert(pool.lazy_max[SMALLEST_K] == BUDDY_LAZY_DEFAULT);
+  void *ptrs[64];
+  for (size_t i = 0; i < 64; i++)
+  {
+    ptrs[i] = buddy_malloc(&pool, 40);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < 64; i++)
+  {
+    buddy_free(&pool, ptrs[i]);
+  }
+  //Frees past the watermark merge as usual
+  assert(pool.nfree[SMALLEST_K] >= BUDDY_LAZY_DEFAULT);
+  assert(pool.nmerge[SMALLEST_K] > 0);
+  assert(buddy_compact(&pool) > 0);
+  check_buddy_pool_full(&pool);
+  assert(buddy_compact(&pool) == 0);
+
+  //Only the whole pool fits, the deferred block has to be merged first
+  void *small = buddy_malloc(&pool, 40);
+  buddy_free(&pool, small);
+  assert(pool.nfree[SMALLEST_K] == 2);
+  void *all = buddy_malloc(&pool, UINT64_C(1) << (MIN_K - 1));
+  assert(all != NULL);
+  buddy_free(&pool, all);
+  check_buddy_pool_full(&pool);
+
+  //Clearing every watermark goes back to eager coalescing
+  buddy_set_lazy(&pool, SMALLEST_K, 4);
+  buddy_set_lazy(&pool, 0, 0);
+  assert(!(pool.flags & BUDDY_LAZY));
+  small = buddy_malloc(&pool, 40);
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* Deferred coalescing from several threads, with and without headers, and a
+* pool that has to compact before it can grow.
+*/
+void test_buddy_lazy_concurrent(void)
+{
+  fprintf(stderr, "->Testing deferred coalescing from %d threads\n", STRESS_THREADS);
+  static const unsigned int modes[] = {0, BUDDY_NOHEADER};
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 24, BUDDY_CONCURRENT | BUDDY_LAZY | modes[m]);
+    buddy_set_lazy(&pool, 0, 4);
+    run_stress(&pool, NULL);
+    buddy_destroy(&pool);
+  }
+  struct buddy_pool pool;
+  buddy_init_reserve(&pool, UINT64_C(1) << MIN_K, UINT64_C(1) << (MIN_K + 2),
+    BUDDY_CONCURRENT | BUDDY_LAZY);
+  void *small = buddy_malloc(&pool, 40);
+  buddy_free(&pool, small);
+  void *big = buddy_malloc(&pool, UINT64_C(1) << (MIN_K + 1));
+  assert(big != NULL);
+  assert(pool.kval_m == MIN_K + 2);
+  buddy_free(&pool, big);
+  buddy_compact(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A lock-free pool does everything a header free pool does from one thread.
+*/
+void test_buddy_lockfree_basic(void)
+{
+  fprintf(stderr, "->Testing a lock-free pool\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_LOCKFREE);
+  assert(pool.flags & BUDDY_CONCURRENT);
+  assert(pool.flags & BUDDY_NOHEADER);
+  check_buddy_pool_full(&pool);
+
+  unsigned char *ptrs[64];
+  for (size_t i = 0; i < 64; i++)
+  {
+    ptrs[i] = buddy_malloc(&pool, 1 + i * 37);
+    assert(ptrs[i] != NULL);
+    memset(ptrs[i], (int)i, 1 + i * 37);
+  }
+  for (size_t i = 0; i < 64; i++)
+  {
+    assert(ptrs[i][0] == (unsigned char)i && ptrs[i][i * 37] == (unsigned char)i);
+    buddy_free(&pool, ptrs[i]);
+  }
+  check_buddy_pool_full(&pool);
+
+  void *all = buddy_malloc(&pool, UINT64_C(1) << MIN_K);
+  assert(all != NULL);
+  assert(buddy_malloc(&pool, 1) == NULL);
+  buddy_free(&pool, all);
+
+  //Resizing in place claims and publishes buddies through the bitmaps
+  void *mem = buddy_malloc(&pool, 64);
+  assert(buddy_realloc(&pool, mem, 4096) == mem);
+  assert(buddy_usable_size(&pool, mem) == 4096);
+  assert(buddy_realloc(&pool, mem, 100) == mem);
+  buddy_free(&pool, mem);
+
+  assert(buddy_malloc_batch(&pool, 256, 64, (void **)ptrs) == 64);
+  buddy_free_batch(&pool, (void **)ptrs, 64);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+#define RACE_THREADS 4
+#define RACE_BLOCK 256
+
+struct race_arg
+{
+  struct buddy_pool *pool;
+  size_t id;
+  pthread_barrier_t *start;
+};
+
+/**
+* Free every block of the pool whose index is id modulo RACE_THREADS, so each
+* block's buddy, and every merged block's buddy after it, is freed by
+* another thread at the same time.
+*/
+static void *race_worker(void *argp)
+{
+  struct race_arg *arg = argp;
+  unsigned char *base = arg->pool->base;
+  size_t n = arg->pool->numbytes / RACE_BLOCK;
+  pthread_barrier_wait(arg->start);
+  for (size_t i = arg->id; i < n; i += RACE_THREADS)
+  {
+    buddy_free(arg->pool, base + i * RACE_BLOCK);
+  }
+  return NULL;
+}
+
+/**
+* Every block handed out is distinct and every pair of buddies freed by racing
+* threads is merged: with no allocations in flight no merge may be missed, so
+* the pool is whole again after each round without buddy_compact.
+*/
+void test_buddy_lockfree_buddy_race(void)
+{
+  fprintf(stderr, "->Testing lock-free coalescing of buddies freed together\n");
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_LOCKFREE);
+  size_t n = pool.numbytes / RACE_BLOCK;
+  unsigned char *seen = calloc(n, 1);
+  for (int round = 0; round < 50; round++)
+  {
+    memset(seen, 0, n);
+    for (size_t i = 0; i < n; i++)
+    {
+      unsigned char *mem = buddy_malloc(&pool, RACE_BLOCK);
+      assert(mem != NULL);
+      size_t idx = (size_t)(mem - (unsigned char *)pool.base) / RACE_BLOCK;
+      assert(idx < n && !seen[idx]);
+      seen[idx] = 1;
+    }
+    assert(buddy_malloc(&pool, 1) == NULL);
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, RACE_THREADS);
+    pthread_t threads[RACE_THREADS];
+    struct race_arg args[RACE_THREADS];
+    for (size_t t = 0; t < RACE_THREADS; t++)
+    {
+      args[t].pool = &pool;
+      args[t].id = t;
+      args[t].start = &start;
+      assert(pthread_create(&threads[t], NULL, race_worker, &args[t]) == 0);
+    }
+    for (size_t t = 0; t < RACE_THREADS; t++)
+    {
+      pthread_join(threads[t], NULL);
+    }
+    pthread_barrier_destroy(&start);
+    check_buddy_pool_full(&pool);
+  }
+  free(seen);
+  buddy_destroy(&pool);
+}
+
+/**
+* Mixed allocations and frees from several threads on a lock-free pool, then
+* threads racing to grow a reserved one.
+*/
+void test_buddy_lockfree_concurrent(void)
+{
+  fprintf(stderr, "->Testing a lock-free pool from %d threads\n", STRESS_THREADS);
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << 24, BUDDY_LOCKFREE);
+  run_stress(&pool, NULL);
+  buddy_destroy(&pool);
+
+  buddy_init_reserve(&pool, UINT64_C(1) << MIN_K, UINT64_C(1) << 26, BUDDY_LOCKFREE);
+  pthread_t threads[STRESS_THREADS];
+  struct stress_arg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++)
+  {
+    args[t].pool = &pool;
+    args[t].id = (unsigned char)(t + 1);
+    assert(pthread_create(&threads[t], NULL, grow_worker, &args[t]) == 0);
+  }
+  for (int t = 0; t < STRESS_THREADS; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+  assert(pool.kval_m > MIN_K + 2);
+  buddy_compact(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+* A set built from the machine's nodes hands out memory from the caller's
+* node, on a single node machine as much as on a big one.
+*/
+void test_buddy_numa(void)
+{
+  fprintf(stderr, "->Testing a NUMA pool set\n");
+  struct buddy_numa set;
+  assert(buddy_numa_init(&set, UINT64_C(1) << MIN_K, BUDDY_CONCURRENT) == 0);
+  assert(set.npools >= 1);
+  void *ptrs[16];
+  for (size_t i = 0; i < 16; i++)
+  {
+    ptrs[i] = buddy_numa_malloc(&set, 1000);
+    assert(ptrs[i] != NULL);
+    assert(buddy_numa_node_of(&set, ptrs[i]) >= 0);
+    memset(ptrs[i], (int)i, 1000);
+  }
+  int node = buddy_numa_node_of(&set, ptrs[0]);
+  void *mem = buddy_numa_malloc_node(&set, 1000, node);
+  assert(buddy_numa_node_of(&set, mem) == node);
+  buddy_numa_free(&set, mem);
+  for (size_t i = 0; i < 16; i++)
+  {
+    buddy_numa_free(&set, ptrs[i]);
+  }
+  for (size_t i = 0; i < set.npools; i++)
+  {
+    check_buddy_pool_full(set.pools[i]);
+  }
+  assert(buddy_numa_node_of(&set, &node) == -1);
+  buddy_numa_destroy(&set);
+
+  int bad = -1;
+  errno = 0;
+  assert(buddy_numa_init_nodes(&set, UINT64_C(1) << MIN_K, 0, &bad, 1) == -1);
+  assert(errno == EINVAL);
+}
+
+/**
+* Two pools on the same node: the second one is only used once the first
+* is full, and an unknown node starts with the first pool.
+*/
+void test_buddy_numa_fallback(void)
+{
+  fprintf(stderr, "->Testing NUMA fallback to the next pool\n");
+  static const int nodes[] = {0, 0};
+  struct buddy_numa set;
+  assert(buddy_numa_init_nodes(&set, UINT64_C(1) << MIN_K, 0, nodes, 2) == 0);
+  assert(set.order[0][0] == 0 && set.order[0][1] == 1);
+  assert(set.order[1][0] == 1 && set.order[1][1] == 0);
+  size_t quarter = (UINT64_C(1) << (MIN_K - 2)) - sizeof(struct buddy_header);
+  void *ptrs[8];
+  for (size_t i = 0; i < 8; i++)
+  {
+    ptrs[i] = buddy_numa_malloc_node(&set, quarter, 7);
+    assert(ptrs[i] != NULL);
+    unsigned char *base = set.pools[i / 4]->base;
+    assert((unsigned char *)ptrs[i] >= base && (unsigned char *)ptrs[i] < base + (UINT64_C(1) << MIN_K));
+  }
+  errno = 0;
+  assert(buddy_numa_malloc_node(&set, quarter, 0) == NULL);
+  assert(errno == ENOMEM);
+  for (size_t i = 0; i < 8; i++)
+  {
+    buddy_numa_free(&set, ptrs[i]);
+  }
+  check_buddy_pool_full(set.pools[0]);
+  check_buddy_pool_full(set.pools[1]);
+  buddy_numa_destroy(&set);
+}
+
+struct remote_arg
+{
+  struct buddy_pool *pool;
+  void **ptrs;
+  size_t n;
+  int how;
+};
+
+/**
+* Free n blocks allocated by another thread, one by one, sized or as a batch
+*/
+static void *remote_worker(void *argp)
+{
+  struct remote_arg *arg = argp;
+  if (arg->how == 2)
+  {
+    buddy_free_batch(arg->pool, arg->ptrs, arg->n);
+    return NULL;
+  }
+  for (size_t i = 0; i < arg->n; i++)
+  {
+    if (arg->how == 1)
+    {
+      buddy_free_sized(arg->pool, arg->ptrs[i], 100);
+    }
+    else
+    {
+      buddy_free(arg->pool, arg->ptrs[i]);
+    }
+  }
+  return NULL;
+}
+
+/**
+* Blocks freed by other threads wait on the owner's queue until it drains
+* them, explicitly or by allocating.
+*/
+void test_buddy_remote_free(void)
+{
+  fprintf(stderr, "->Testing remote frees into an owned pool\n");
+  static const unsigned int modes[] = {0, BUDDY_NOHEADER};
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_REMOTE_FREE | modes[m]);
+    void *ptrs[3][64];
+    for (int round = 0; round < 2; round++)
+    {
+      for (size_t t = 0; t < 3; t++)
+      {
+        for (size_t i = 0; i < 64; i++)
+        {
+          ptrs[t][i] = buddy_malloc(&pool, 100);
+          assert(ptrs[t][i] != NULL);
+        }
+      }
+      pthread_t threads[3];
+      struct remote_arg args[3];
+      for (size_t t = 0; t < 3; t++)
+      {
+        args[t].pool = &pool;
+        args[t].ptrs = ptrs[t];
+        args[t].n = 64;
+        args[t].how = (int)t;
+        assert(pthread_create(&threads[t], NULL, remote_worker, &args[t]) == 0);
+      }
+      for (size_t t = 0; t < 3; t++)
+      {
+        pthread_join(threads[t], NULL);
+      }
+      assert(pool.remote != NULL);
+      assert(pool.avail[pool.kval_m].next == &pool.avail[pool.kval_m]);
+      if (round == 0)
+      {
+        assert(buddy_drain_remote(&pool) == 3 * 64);
+      }
+      else
+      {
+        //The owner's next allocation takes the whole queue
+        void *mem = buddy_malloc(&pool, 100);
+        assert(pool.remote == NULL);
+        buddy_free(&pool, mem);
+      }
+      check_buddy_pool_full(&pool);
+    }
+    buddy_destroy(&pool);
+  }
+}
+
+#define PIPE_ITEMS 20000
+#define PIPE_CONSUMERS 3
+
+struct pipe
+{
+  struct buddy_pool *pool;
+  unsigned char *items[PIPE_ITEMS];
+  size_t published; /*Items the owner has handed out so far*/
+  size_t next; /*Next item a consumer takes*/
+};
+
+static size_t pipe_size(size_t i)
+{
+  return 1 + (i * 7919) % 512;
+}
+
+static void *pipe_consumer(void *argp)
+{
+  struct pipe *pipe = argp;
+  while (true)
+  {
+    size_t i = __atomic_fetch_add(&pipe->next, 1, __ATOMIC_RELAXED);
+    if (i >= PIPE_ITEMS)
+    {
+      return NULL;
+    }
+    while (__atomic_load_n(&pipe->published, __ATOMIC_ACQUIRE) <= i)
+    {
+      sched_yield();
+    }
+    unsigned char *mem = pipe->items[i];
+    assert(mem[0] == (unsigned char)i && mem[pipe_size(i) - 1] == (unsigned char)i);
+    buddy_free(pipe->pool, mem);
+  }
+}
+
+/**
+* The owner allocates while consumers free the same buffers at the same time
+* without any locks in the pool.
+*/
+void test_buddy_remote_free_pipeline(void)
+{
+  fprintf(stderr, "->Testing a producer pool with %d freeing consumers\n", PIPE_CONSUMERS);
+  struct buddy_pool pool;
+  buddy_init_flags(&pool, UINT64_C(1) << 24, BUDDY_REMOTE_FREE);
+  struct pipe *pipe = calloc(1, sizeof(struct pipe));
+  pipe->pool = &pool;
+  pthread_t threads[PIPE_CONSUMERS];
+  for (size_t t = 0; t < PIPE_CONSUMERS; t++)
+  {
+    assert(pthread_create(&threads[t], NULL, pipe_consumer, pipe) == 0);
+  }
+  for (size_t i = 0; i < PIPE_ITEMS; i++)
+  {
+    unsigned char *mem = buddy_malloc(&pool, pipe_size(i));
+    assert(mem != NULL);
+    memset(mem, (int)(unsigned char)i, pipe_size(i));
+    pipe->items[i] = mem;
+    __atomic_store_n(&pipe->published, i + 1, __ATOMIC_RELEASE);
+  }
+  for (size_t t = 0; t < PIPE_CONSUMERS; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+  buddy_drain_remote(&pool);
+  check_buddy_pool_full(&pool);
+  struct buddy_stats stats;
+  buddy_stats(&pool, &stats);
+  assert(stats.allocs == PIPE_ITEMS && stats.frees == PIPE_ITEMS);
+  assert(stats.bytes_in_use == 0 && stats.peak_bytes_in_use > 0);
+  free(pipe);
+  buddy_destroy(&pool);
+}
+
+/**
+* Counters of a pool used by one thread are exact.
+*/
+void test_buddy_stats(void)
+{
+  fprintf(stderr, "->Testing allocation statistics\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  struct buddy_stats stats;
+  buddy_stats(&pool, &stats);
+  assert(stats.allocs == 0 && stats.bytes_in_use == 0 && stats.peak_bytes_in_use == 0);
+  assert(stats.pool_bytes == UINT64_C(1) << MIN_K);
+  assert(stats.bytes_free == stats.pool_bytes);
+  assert(stats.free_blocks[MIN_K] == 1);
+
+  //100 bytes plus the header take a 128 byte block
+  void *a = buddy_malloc(&pool, 100);
+  void *b = buddy_calloc(&pool, 10, 100);
+  assert(a != NULL && b != NULL);
+  buddy_stats(&pool, &stats);
+  assert(stats.allocs == 2 && stats.frees == 0);
+  assert(stats.bytes_requested == 1100);
+  assert(stats.bytes_granted == 128 + 1024);
+  assert(stats.bytes_in_use == 128 + 1024);
+  assert(stats.bytes_free + stats.bytes_in_use == stats.pool_bytes);
+  assert(stats.splits[7] == 1 && stats.splits[10] == 1);
+  assert(stats.splits[MIN_K - 1] == 1);
+
+  assert(buddy_malloc(&pool, UINT64_C(1) << MIN_K) == NULL);
+  buddy_free(&pool, b);
+  buddy_stats(&pool, &stats);
+  assert(stats.failed == 1 && stats.frees == 1);
+  assert(stats.bytes_in_use == 128);
+  assert(stats.peak_bytes_in_use == 128 + 1024);
+
+  //Growing in place counts the new size, the block is still one allocation
+  a = buddy_realloc(&pool, a, 200);
+  assert(a != NULL);
+  buddy_stats(&pool, &stats);
+  assert(stats.allocs == 2 && stats.bytes_in_use == 256);
+  assert(stats.bytes_requested == 1300);
+
+  void *ptrs[8];
+  assert(buddy_malloc_batch(&pool, 56, 8, ptrs) == 8);
+  buddy_free_batch(&pool, ptrs, 8);
+  buddy_free(&pool, a);
+  buddy_stats(&pool, &stats);
+  assert(stats.allocs == 10 && stats.frees == 10);
+  assert(stats.bytes_in_use == 0);
+  assert(stats.peak_bytes_in_use == 128 + 1024);
+  assert(stats.free_blocks[MIN_K] == 1);
+  assert(stats.merges[MIN_K - 1] == stats.splits[MIN_K - 1]);
+  buddy_destroy(&pool);
+}
+
+/**
+* Free memory split into blocks that are too small shows up in the report.
+*/
+void test_buddy_fragmentation(void)
+{
+  fprintf(stderr, "->Testing the fragmentation report\n");
+  size_t quarter = UINT64_C(1) << (MIN_K - 2);
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  struct buddy_frag frag;
+  assert(buddy_largest_free(&pool) == (UINT64_C(1) << MIN_K) - sizeof(struct buddy_header));
+  buddy_fragmentation(&pool, &frag);
+  assert(frag.bytes_free == UINT64_C(1) << MIN_K);
+  assert(frag.largest_free == UINT64_C(1) << MIN_K);
+  assert(frag.index == 0.0 && frag.unusable[MIN_K] == 0.0);
+
+  void *ptrs[4];
+  for (size_t i = 0; i < 4; i++)
+  {
+    ptrs[i] = buddy_malloc(&pool, quarter - sizeof(struct buddy_header));
+    assert(ptrs[i] != NULL);
+  }
+  assert(buddy_largest_free(&pool) == 0);
+  buddy_fragmentation(&pool, &frag);
+  assert(frag.bytes_free == 0 && frag.index == 0.0);
+
+  //Half the pool is free but no request over a quarter fits
+  buddy_free(&pool, ptrs[0]);
+  buddy_free(&pool, ptrs[2]);
+  assert(buddy_largest_free(&pool) == quarter - sizeof(struct buddy_header));
+  assert(buddy_malloc(&pool, quarter) == NULL);
+  buddy_fragmentation(&pool, &frag);
+  assert(frag.bytes_free == 2 * quarter);
+  assert(frag.bytes_free_by_class[MIN_K - 2] == 2 * quarter);
+  assert(frag.largest_free == quarter);
+  assert(frag.index == 0.5);
+  assert(frag.unusable[MIN_K - 2] == 0.0 && frag.unusable[MIN_K - 1] == 1.0);
+
+  buddy_free(&pool, ptrs[1]);
+  buddy_free(&pool, ptrs[3]);
+  buddy_fragmentation(&pool, &frag);
+  assert(frag.index == 0.0);
+  buddy_destroy(&pool);
+}
+
+struct walk_tally
+{
+  struct buddy_pool *pool;
+  unsigned char *next; /*Where the next block has to start, NULL to not check*/
+  size_t blocks;
+  size_t allocated;
+  size_t bytes_in_use;
+  size_t bytes_free;
+  size_t stop_after; /*Stop the walk with 7 after this many blocks, 0 for never*/
+};
+
+static int walk_count(void *ctx, void *block, size_t kval, bool is_free)
+{
+  struct walk_tally *tally = ctx;
+  size_t offset = (size_t)((unsigned char *)block - (unsigned char *)tally->pool->base);
+  assert(kval >= SMALLEST_K && kval <= tally->pool->kval_m);
+  assert((offset & ((UINT64_C(1) << kval) - 1)) == 0);
+  assert(tally->next == NULL || tally->next == block);
+  if (tally->next != NULL)
+  {
+    tally->next = (unsigned char *)block + (UINT64_C(1) << kval);
+  }
+  tally->blocks++;
+  if (is_free)
+  {
+    tally->bytes_free += UINT64_C(1) << kval;
+  }
+  else
+  {
+    tally->allocated++;
+    tally->bytes_in_use += UINT64_C(1) << kval;
+  }
+  return tally->blocks == tally->stop_after ? 7 : 0;
+}
+
+/**
+* A walk of a quiet pool sees every block once, in order, whether it is done
+* at once or one block per step.
+*/
+void test_buddy_walk(void)
+{
+  fprintf(stderr, "->Testing buddy_walk\n");
+  static const unsigned int modes[] = {0, BUDDY_NOHEADER};
+  for (size_t m = 0; m < 2; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, modes[m]);
+    struct walk_tally tally = {.pool = &pool, .next = pool.base};
+    assert(buddy_walk(&pool, walk_count, &tally) == 0);
+    assert(tally.blocks == 1 && tally.bytes_free == UINT64_C(1) << MIN_K);
+
+    void *ptrs[100];
+    for (size_t i = 0; i < 100; i++)
+    {
+      ptrs[i] = buddy_malloc(&pool, 1 + (size_t)rand() % 3000);
+      assert(ptrs[i] != NULL);
+    }
+    for (size_t i = 0; i < 100; i += 3)
+    {
+      buddy_free(&pool, ptrs[i]);
+      ptrs[i] = NULL;
+    }
+    struct buddy_stats stats;
+    buddy_stats(&pool, &stats);
+
+    struct walk_tally whole = {.pool = &pool, .next = pool.base};
+    assert(buddy_walk(&pool, walk_count, &whole) == 0);
+    assert(whole.next == (unsigned char *)pool.base + pool.numbytes);
+    assert(whole.allocated == 66);
+    assert(whole.bytes_in_use == stats.bytes_in_use);
+    assert(whole.bytes_free == stats.bytes_free);
+
+    struct walk_tally steps = {.pool = &pool, .next = pool.base};
+    struct buddy_walk_cursor cursor = {0};
+    size_t nsteps = 0;
+    while (buddy_walk_step(&pool, &cursor, 1, walk_count, &steps))
+    {
+      nsteps++;
+    }
+    assert(nsteps + 1 == whole.blocks);
+    assert(steps.blocks == whole.blocks && steps.bytes_in_use == whole.bytes_in_use);
+
+    struct walk_tally stop = {.pool = &pool, .stop_after = 3};
+    assert(buddy_walk(&pool, walk_count, &stop) == 7);
+    assert(stop.blocks == 3);
+
+    for (size_t i = 0; i < 100; i++)
+    {
+      buddy_free(&pool, ptrs[i]);
+    }
+    buddy_destroy(&pool);
+  }
+}
+
+struct walk_loop
+{
+  struct buddy_pool *pool;
+  int done;
+  size_t walks;
+};
+
+static void *walk_worker(void *argp)
+{
+  struct walk_loop *loop = argp;
+  while (!__atomic_load_n(&loop->done, __ATOMIC_ACQUIRE))
+  {
+    struct walk_tally tally = {.pool = loop->pool};
+    struct buddy_walk_cursor cursor = {0};
+    while (buddy_walk_step(loop->pool, &cursor, 16, walk_count, &tally))
+    {
+    }
+    assert(tally.bytes_in_use + tally.bytes_free <= loop->pool->numbytes);
+    loop->walks++;
+  }
+  return NULL;
+}
+
+/**
+* Walk concurrent pools in short steps while the stress workers run.
+*/
+void test_buddy_walk_concurrent(void)
+{
+  fprintf(stderr, "->Testing buddy_walk_step alongside %d threads\n", STRESS_THREADS);
+  static const unsigned int modes[] = {BUDDY_CONCURRENT, BUDDY_CONCURRENT | BUDDY_NOHEADER, BUDDY_LOCKFREE};
+  for (size_t m = 0; m < 3; m++)
+  {
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 24, modes[m]);
+    struct walk_loop loop = {.pool = &pool};
+    pthread_t walker;
+    assert(pthread_create(&walker, NULL, walk_worker, &loop) == 0);
+    run_stress(&pool, NULL);
+    __atomic_store_n(&loop.done, 1, __ATOMIC_RELEASE);
+    pthread_join(walker, NULL);
+    struct walk_tally tally = {.pool = &pool, .next = pool.base};
+    assert(buddy_walk(&pool, walk_count, &tally) == 0);
+    assert(tally.blocks == 1 && tally.bytes_free == pool.numbytes);
+    buddy_destroy(&pool);
+  }
+}
+
+/**
+* The C library's malloc extensions keep their contract. check-preload runs
+* this on top of libbuddymalloc.so, which replaces them.
+*/
+void test_libc_malloc_extensions(void)
+{
+#ifdef __GLIBC__
+  fprintf(stderr, "->Testing reallocarray, memalign, valloc and pvalloc\n");
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  unsigned char *p = reallocarray(NULL, 10, 100);
+  assert(p != NULL);
+  memset(p, 0xab, 1000);
+  p = reallocarray(p, 100, 100);
+  assert(p != NULL);
+  assert(p[0] == 0xab && p[999] == 0xab);
+  //A product that wraps fails and leaves the block alone. The sanitizers
+  //abort on it instead of returning NULL.
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+  volatile size_t huge = SIZE_MAX / 2;
+  errno = 0;
+  assert(reallocarray(p, huge, 3) == NULL);
+  assert(errno == ENOMEM);
+  assert(p[999] == 0xab);
+#endif
+  free(p);
+
+  size_t aligns[] = {8, 64, 4096, 65536};
+  for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++)
+  {
+    unsigned char *m = memalign(aligns[i], 100);
+    assert(m != NULL);
+    assert(((uintptr_t)m & (aligns[i] - 1)) == 0);
+    memset(m, 0xcd, 100);
+    free(m);
+  }
+
+  unsigned char *v = valloc(100);
+  assert(v != NULL);
+  assert(((uintptr_t)v & (page - 1)) == 0);
+  free(v);
+
+  //pvalloc hands out whole pages
+  unsigned char *pv = pvalloc(page + 1);
+  assert(pv != NULL);
+  assert(((uintptr_t)pv & (page - 1)) == 0);
+  assert(malloc_usable_size(pv) >= 2 * page);
+  memset(pv, 0xef, 2 * page);
+  free(pv);
+  pv = pvalloc(0);
+  assert(pv != NULL);
+  free(pv);
+#endif
+}
+
 int main(void) {
 time_t t;
   unsigned seed = (unsigned)time(&t);
@@ -394,6 +2562,7 @@ time_t t;
   RUN_TEST(test_btok_exact_power_of_two);
   RUN_TEST(test_btok_non_power_of_two);
   RUN_TEST(test_btok_large_values);
+  RUN_TEST(test_btok_boundaries);
   RUN_TEST(test_buddy_calc_middle);
   RUN_TEST(test_buddy_calc_first_block);
   RUN_TEST(test_buddy_calc_last_block);
@@ -405,5 +2574,56 @@ time_t t;
   RUN_TEST(test_buddy_malloc_size_larger_than_pool);
   RUN_TEST(test_buddy_malloc_exact_power_of_two);
   RUN_TEST(test_buddy_malloc_non_power_of_two);
+  RUN_TEST(test_buddy_malloc_fill_smallest);
+  RUN_TEST(test_buddy_free_keeps_reserved_buddy);
+  RUN_TEST(test_buddy_free_misaligned_pointer);
+  RUN_TEST(test_buddy_avail_mask);
+  RUN_TEST(test_buddy_realloc_malloc_and_free);
+  RUN_TEST(test_buddy_realloc_shrink_in_place);
+  RUN_TEST(test_buddy_realloc_grow_in_place);
+  RUN_TEST(test_buddy_realloc_grow_copy);
+  RUN_TEST(test_buddy_realloc_grow_partial);
+  RUN_TEST(test_buddy_concurrent_stress);
+  RUN_TEST(test_buddy_cache_reuse);
+  RUN_TEST(test_buddy_cache_depth);
+  RUN_TEST(test_buddy_header_size);
+  RUN_TEST(test_buddy_noheader_layout);
+  RUN_TEST(test_buddy_noheader_free_skips_buddy);
+  RUN_TEST(test_buddy_noheader_realloc);
+  RUN_TEST(test_buddy_noheader_concurrent_stress);
+  RUN_TEST(test_buddy_cache_noheader);
+  RUN_TEST(test_buddy_init_base_alignment);
+  RUN_TEST(test_buddy_aligned_alloc);
+  RUN_TEST(test_buddy_aligned_alloc_noheader);
+  RUN_TEST(test_buddy_aligned_realloc);
+  RUN_TEST(test_buddy_decommit);
+  RUN_TEST(test_buddy_init_hugepages);
+  RUN_TEST(test_buddy_hugetlb_exact);
+  RUN_TEST(test_buddy_arena_grow);
+  RUN_TEST(test_buddy_arena_realloc);
+  RUN_TEST(test_buddy_arena_lockfree);
+  RUN_TEST(test_buddy_arena_lazy);
+  RUN_TEST(test_buddy_arena_concurrent);
+  RUN_TEST(test_buddy_init_reserve);
+  RUN_TEST(test_buddy_init_reserve_concurrent);
+  RUN_TEST(test_buddy_slab_basic);
+  RUN_TEST(test_buddy_slab_release);
+  RUN_TEST(test_buddy_batch);
+  RUN_TEST(test_buddy_usable_size);
+  RUN_TEST(test_buddy_calloc);
+  RUN_TEST(test_buddy_lazy);
+  RUN_TEST(test_buddy_lazy_concurrent);
+  RUN_TEST(test_buddy_lockfree_basic);
+  RUN_TEST(test_buddy_lockfree_buddy_race);
+  RUN_TEST(test_buddy_lockfree_concurrent);
+  RUN_TEST(test_buddy_numa);
+  RUN_TEST(test_buddy_numa_fallback);
+  RUN_TEST(test_buddy_remote_free);
+  RUN_TEST(test_buddy_remote_free_pipeline);
+  RUN_TEST(test_buddy_stats);
+  RUN_TEST(test_buddy_fragmentation);
+  RUN_TEST(test_buddy_walk);
+  RUN_TEST(test_buddy_walk_concurrent);
+  RUN_TEST(test_libc_malloc_extensions);
   return UNITY_END();
 }
\ No newline at end of file